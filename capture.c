@@ -0,0 +1,613 @@
+#include "sr_plan.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "access/xact.h"
+#include "catalog/index.h"
+#include "catalog/namespace.h"
+#include "postmaster/bgworker.h"
+#include "storage/dsm.h"
+#include "storage/latch.h"
+#include "storage/proc.h"
+#include "storage/shm_mq.h"
+#include "tcop/tcopprot.h"
+#include "utils/array.h"
+#include "utils/hsearch.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/resowner.h"
+#include "port/atomics.h"
+
+PG_FUNCTION_INFO_V1(sr_plan_capture_batch);
+
+/*
+ * Layout of dynamic shared memory segment of sr_plan_capture_batch():
+ * header, GUC state of leader, settings jsonb, offsets of query texts,
+ * query texts and one message queue per worker.
+ */
+typedef struct SrPlanCaptureShared
+{
+	Oid					database_id;
+	Oid					user_id;
+	int					nqueries;
+	pg_atomic_uint32	next_query;		/* next query to be planned */
+	Size				guc_offset;
+	Size				settings_offset;	/* 0 if there're no settings */
+	Size				queries_offset;
+	Size				mq_offset;
+} SrPlanCaptureShared;
+
+/*
+ * Message sent from worker to leader, followed by query text, plan,
+ * deps and template of plan if any
+ */
+typedef struct SrPlanCaptureMessage
+{
+	int32		query_hash;
+	int32		plan_hash;
+	int32		shape_hash;
+	int32		query_len;
+	int32		plan_len;
+	int32		deps_len;
+	int32		template_len;
+} SrPlanCaptureMessage;
+
+static bool sr_plan_capture_query(const char *query_string, Oid schema_oid,
+								  shm_mq_handle *mqh);
+static bool sr_plan_send_plan(Query *query, const char *query_string,
+							  Oid schema_oid, shm_mq_handle *mqh);
+static List *sr_plan_receive_plans(shm_mq_handle **mqh, int nworkers);
+
+Datum
+sr_plan_capture_batch(PG_FUNCTION_ARGS)
+{
+	ArrayType	   *queries;
+	Jsonb		   *settings = NULL;
+	int				nworkers;
+	Datum		   *elems;
+	bool		   *elem_nulls;
+	int				nelems,
+					nqueries = 0,
+					i;
+	Size			size,
+					offset;
+	dsm_segment	   *seg;
+	SrPlanCaptureShared *shared;
+	Size		   *query_offsets;
+	shm_mq_handle **mqh;
+	int				nlaunched = 0;
+	List		   *captured;
+	ListCell	   *lc;
+	int				result;
+	Oid				schema_oid;
+	Size			guc_size;
+
+	/* Plans are written bypassing sr_plans permissions */
+	if (!superuser())
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("must be superuser to capture plans in batch")));
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_INT32(0);
+
+	queries = PG_GETARG_ARRAYTYPE_P(0);
+	if (!PG_ARGISNULL(1))
+	{
+		settings = PG_GETARG_JSONB(1);
+		sr_plan_check_settings(settings);
+	}
+	nworkers = PG_ARGISNULL(2) ? 1 : PG_GETARG_INT32(2);
+
+	if (nworkers < 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("number of workers must be positive")));
+
+	schema_oid = get_sr_plan_schema();
+	if (!OidIsValid(schema_oid))
+		elog(ERROR, "Cannot find sr_plan schema");
+
+	deconstruct_array(queries, TEXTOID, -1, false, 'i',
+					  &elems, &elem_nulls, &nelems);
+
+	/* Estimate size of shared memory segment */
+	size = MAXALIGN(sizeof(SrPlanCaptureShared));
+	guc_size = EstimateGUCStateSpace();
+	size = add_size(size, MAXALIGN(guc_size));
+	if (settings)
+		size = add_size(size, MAXALIGN(VARSIZE(settings)));
+	size = add_size(size, MAXALIGN(mul_size(nelems, sizeof(Size))));
+	for (i = 0; i < nelems; i++)
+	{
+		if (elem_nulls[i])
+			continue;
+		size = add_size(size, VARSIZE_ANY_EXHDR(DatumGetPointer(elems[i])) + 1);
+	}
+	size = MAXALIGN(size);
+	size = add_size(size, mul_size(nworkers, SR_PLAN_CAPTURE_QUEUE_SIZE));
+
+	seg = dsm_create(size, 0);
+	shared = (SrPlanCaptureShared *) dsm_segment_address(seg);
+	shared->database_id = MyDatabaseId;
+	shared->user_id = GetUserId();
+	pg_atomic_init_u32(&shared->next_query, 0);
+	offset = MAXALIGN(sizeof(SrPlanCaptureShared));
+
+	/*
+	 * Workers plan queries with search_path, template mode and other
+	 * settings of this session, like parallel workers do
+	 */
+	shared->guc_offset = offset;
+	SerializeGUCState(guc_size, (char *) shared + offset);
+	offset += MAXALIGN(guc_size);
+
+	shared->settings_offset = 0;
+	if (settings)
+	{
+		shared->settings_offset = offset;
+		memcpy((char *) shared + offset, settings, VARSIZE(settings));
+		offset += MAXALIGN(VARSIZE(settings));
+	}
+
+	shared->queries_offset = offset;
+	query_offsets = (Size *) ((char *) shared + offset);
+	offset += MAXALIGN(mul_size(nelems, sizeof(Size)));
+	for (i = 0; i < nelems; i++)
+	{
+		text   *query;
+		Size	len;
+
+		if (elem_nulls[i])
+			continue;
+
+		query = DatumGetTextPP(elems[i]);
+		len = VARSIZE_ANY_EXHDR(query);
+		memcpy((char *) shared + offset, VARDATA_ANY(query), len);
+		((char *) shared)[offset + len] = '\0';
+		query_offsets[nqueries++] = offset;
+		offset += len + 1;
+	}
+	shared->nqueries = nqueries;
+	shared->mq_offset = MAXALIGN(offset);
+
+	/* Launch workers, each one gets its own queue to send plans back */
+	mqh = (shm_mq_handle **) palloc0(nworkers * sizeof(shm_mq_handle *));
+	for (i = 0; i < nworkers && i < nqueries; i++)
+	{
+		BackgroundWorker		worker;
+		BackgroundWorkerHandle *handle;
+		shm_mq				   *mq;
+
+		mq = shm_mq_create((char *) shared + shared->mq_offset +
+						   i * SR_PLAN_CAPTURE_QUEUE_SIZE,
+						   SR_PLAN_CAPTURE_QUEUE_SIZE);
+		shm_mq_set_receiver(mq, MyProc);
+
+		memset(&worker, 0, sizeof(worker));
+		worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
+			BGWORKER_BACKEND_DATABASE_CONNECTION;
+		worker.bgw_start_time = BgWorkerStart_ConsistentState;
+		worker.bgw_restart_time = BGW_NEVER_RESTART;
+		snprintf(worker.bgw_name, BGW_MAXLEN, "sr_plan capture worker %d", i);
+		snprintf(worker.bgw_library_name, BGW_MAXLEN, "sr_plan");
+		snprintf(worker.bgw_function_name, BGW_MAXLEN, "sr_plan_capture_main");
+		worker.bgw_main_arg = UInt32GetDatum(dsm_segment_handle(seg));
+		worker.bgw_notify_pid = MyProcPid;
+		memcpy(worker.bgw_extra, &i, sizeof(int));
+
+		if (!RegisterDynamicBackgroundWorker(&worker, &handle))
+			break;
+
+		mqh[i] = shm_mq_attach(mq, seg, handle);
+		nlaunched++;
+	}
+
+	if (nqueries > 0 && nlaunched == 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_RESOURCES),
+				 errmsg("could not register background process"),
+				 errhint("You may need to increase max_worker_processes.")));
+
+	captured = sr_plan_receive_plans(mqh, nlaunched);
+	dsm_detach(seg);
+
+	foreach(lc, captured)
+		((SrPlanCaptured *) lfirst(lc))->settings = settings;
+
+	result = sr_plan_store_plans(schema_oid, captured);
+
+	PG_RETURN_INT32(result);
+}
+
+/*
+ * Collect plans from all workers until they detach from their queues.
+ */
+static List *
+sr_plan_receive_plans(shm_mq_handle **mqh, int nworkers)
+{
+	List   *captured = NIL;
+	int		nactive = nworkers;
+
+	while (nactive > 0)
+	{
+		bool	received = false;
+		int		i;
+
+		for (i = 0; i < nworkers; i++)
+		{
+			shm_mq_result			res;
+			Size					nbytes;
+			void				   *data;
+			SrPlanCaptureMessage   *msg;
+			SrPlanCaptured		   *plan;
+			char				   *ptr;
+
+			if (mqh[i] == NULL)
+				continue;
+
+			res = shm_mq_receive(mqh[i], &nbytes, &data, true);
+			if (res == SHM_MQ_WOULD_BLOCK)
+				continue;
+
+			if (res == SHM_MQ_DETACHED)
+			{
+				mqh[i] = NULL;
+				nactive--;
+				continue;
+			}
+
+			received = true;
+			msg = (SrPlanCaptureMessage *) data;
+			ptr = (char *) data + sizeof(SrPlanCaptureMessage);
+
+			plan = (SrPlanCaptured *) palloc(sizeof(SrPlanCaptured));
+			plan->query_hash = msg->query_hash;
+			plan->plan_hash = msg->plan_hash;
+			plan->shape_hash = msg->shape_hash;
+			plan->query = cstring_to_text_with_len(ptr, msg->query_len);
+			ptr += msg->query_len;
+			plan->plan = (Jsonb *) palloc(msg->plan_len);
+			memcpy(plan->plan, ptr, msg->plan_len);
+			ptr += msg->plan_len;
+			plan->deps = (ArrayType *) palloc(msg->deps_len);
+			memcpy(plan->deps, ptr, msg->deps_len);
+			ptr += msg->deps_len;
+			plan->template = NULL;
+			if (msg->template_len > 0)
+			{
+				plan->template = (Jsonb *) palloc(msg->template_len);
+				memcpy(plan->template, ptr, msg->template_len);
+			}
+			plan->settings = NULL;
+			plan->profile = sr_plan_profile;
+
+			captured = lappend(captured, plan);
+		}
+
+		if (!received && nactive > 0)
+		{
+			int		rc;
+
+#if PG_VERSION_NUM >= 100000
+			rc = WaitLatch(MyLatch, WL_LATCH_SET | WL_POSTMASTER_DEATH, 0,
+						   PG_WAIT_EXTENSION);
+#else
+			rc = WaitLatch(MyLatch, WL_LATCH_SET | WL_POSTMASTER_DEATH, 0);
+#endif
+			ResetLatch(MyLatch);
+
+			/* Workers won't detach from their queues without postmaster */
+			if (rc & WL_POSTMASTER_DEATH)
+				ereport(FATAL,
+						(errcode(ERRCODE_ADMIN_SHUTDOWN),
+						 errmsg("terminating connection due to unexpected postmaster exit")));
+
+			CHECK_FOR_INTERRUPTS();
+		}
+	}
+
+	return captured;
+}
+
+/*
+ * Insert captured plans into "sr_plans" skipping duplicates by shape_hash,
+ * heap tuples go first and then index entries in a single pass.
+ */
+int
+sr_plan_store_plans(Oid schema_oid, List *captured)
+{
+	Relation	sr_plans_heap;
+	Relation	query_index_rel;
+	Oid			sr_plans_oid;
+	Oid			query_index_rel_oid;
+	HTAB	   *seen;
+	HASHCTL		ctl;
+	HeapTuple  *tuples;
+	int			ntuples = 0;
+	int			i;
+	ListCell   *lc;
+#if PG_VERSION_NUM >= 100000
+	IndexInfo  *indexInfo;
+#endif
+
+	if (captured == NIL)
+		return 0;
+
+	sr_plans_oid = get_relname_relid(SR_PLANS_TABLE_NAME, schema_oid);
+	query_index_rel_oid = get_relname_relid(SR_PLANS_TABLE_QUERY_INDEX_NAME, schema_oid);
+	if (!OidIsValid(sr_plans_oid) || !OidIsValid(query_index_rel_oid))
+		elog(ERROR, "Cannot find %s table", SR_PLANS_TABLE_NAME);
+
+	sr_plans_heap = heap_open(sr_plans_oid, RowExclusiveLock);
+	if (RelationGetDescr(sr_plans_heap)->natts != Natts_sr_plans)
+		elog(ERROR, "Unexpected format of %s table, try ALTER EXTENSION sr_plan UPDATE",
+			 SR_PLANS_TABLE_NAME);
+	query_index_rel = index_open(query_index_rel_oid, RowExclusiveLock);
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(SrPlanStatsKey);
+	ctl.entrysize = sizeof(SrPlanStatsKey);
+	ctl.hcxt = CurrentMemoryContext;
+	seen = hash_create("sr_plan captured plans", list_length(captured),
+					   &ctl, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	tuples = (HeapTuple *) palloc(list_length(captured) * sizeof(HeapTuple));
+	foreach(lc, captured)
+	{
+		SrPlanCaptured *plan = (SrPlanCaptured *) lfirst(lc);
+		SrPlanStatsKey	key;
+		bool			found;
+		Datum			values[Natts_sr_plans];
+		bool			nulls[Natts_sr_plans];
+
+		memset(&key, 0, sizeof(key));
+		key.profile_hash = sr_plan_profile_hash(plan->profile);
+		key.query_hash = plan->query_hash;
+		/* Plans of the same shape are duplicates */
+		key.plan_hash = sr_plan_capture_once ? 0 : plan->shape_hash;
+		hash_search(seen, &key, HASH_ENTER, &found);
+		if (found)
+			continue;
+
+		if (sr_plans_find_plan(sr_plans_heap, query_index_rel,
+							   plan->query_hash, plan->plan_hash,
+							   plan->shape_hash, plan->profile,
+							   sr_plan_capture_once) != NULL)
+			continue;
+
+		memset(nulls, false, sizeof(nulls));
+		values[Anum_sr_plans_query_hash - 1] = Int32GetDatum(plan->query_hash);
+		values[Anum_sr_plans_plan_hash - 1] = Int32GetDatum(plan->plan_hash);
+		values[Anum_sr_plans_query - 1] = PointerGetDatum(plan->query);
+		values[Anum_sr_plans_plan - 1] = PointerGetDatum(plan->plan);
+		values[Anum_sr_plans_enable - 1] = BoolGetDatum(false);
+		values[Anum_sr_plans_valid - 1] = BoolGetDatum(true);
+		values[Anum_sr_plans_hits - 1] = Int64GetDatum(0);
+		nulls[Anum_sr_plans_last_hit - 1] = true;
+		values[Anum_sr_plans_deps - 1] = PointerGetDatum(plan->deps);
+		nulls[Anum_sr_plans_expires - 1] = true;
+		values[Anum_sr_plans_shape_hash - 1] = Int32GetDatum(plan->shape_hash);
+		nulls[Anum_sr_plans_reason - 1] = true;
+		values[Anum_sr_plans_template - 1] = PointerGetDatum(plan->template);
+		nulls[Anum_sr_plans_template - 1] = (plan->template == NULL);
+		values[Anum_sr_plans_settings - 1] = PointerGetDatum(plan->settings);
+		nulls[Anum_sr_plans_settings - 1] = (plan->settings == NULL);
+		values[Anum_sr_plans_profile - 1] = CStringGetTextDatum(plan->profile);
+
+		tuples[ntuples++] = heap_form_tuple(RelationGetDescr(sr_plans_heap),
+											values, nulls);
+	}
+
+	if (ntuples > 0)
+		heap_multi_insert(sr_plans_heap, tuples, ntuples,
+						  GetCurrentCommandId(true), 0, NULL);
+
+#if PG_VERSION_NUM >= 100000
+	indexInfo = BuildIndexInfo(query_index_rel);
+#endif
+	for (i = 0; i < ntuples; i++)
+	{
+		Datum	values[1];
+		bool	nulls[1] = {false};
+		bool	isnull;
+
+		values[0] = heap_getattr(tuples[i], Anum_sr_plans_query_hash,
+								 RelationGetDescr(sr_plans_heap), &isnull);
+		index_insert(query_index_rel,
+					 values, nulls,
+					 &(tuples[i]->t_self),
+					 sr_plans_heap,
+#if PG_VERSION_NUM >= 100000
+					 UNIQUE_CHECK_NO, indexInfo);
+#else
+					 UNIQUE_CHECK_NO);
+#endif
+	}
+
+	index_close(query_index_rel, RowExclusiveLock);
+	heap_close(sr_plans_heap, RowExclusiveLock);
+
+	return ntuples;
+}
+
+void
+sr_plan_capture_main(Datum main_arg)
+{
+	dsm_segment			   *seg;
+	SrPlanCaptureShared	   *shared;
+	shm_mq				   *mq;
+	shm_mq_handle		   *mqh;
+	Size				   *query_offsets;
+	int						worker_number;
+	Oid						schema_oid;
+
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+	memcpy(&worker_number, MyBgworkerEntry->bgw_extra, sizeof(int));
+
+	CurrentResourceOwner = ResourceOwnerCreate(NULL, "sr_plan capture worker");
+	seg = dsm_attach(DatumGetUInt32(main_arg));
+	if (seg == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("could not map dynamic shared memory segment")));
+
+	shared = (SrPlanCaptureShared *) dsm_segment_address(seg);
+	mq = (shm_mq *) ((char *) shared + shared->mq_offset +
+					 worker_number * SR_PLAN_CAPTURE_QUEUE_SIZE);
+	shm_mq_set_sender(mq, MyProc);
+	mqh = shm_mq_attach(mq, seg, NULL);
+
+	BackgroundWorkerInitializeConnectionByOid(shared->database_id,
+											  shared->user_id);
+
+	/* Plans are made from scratch, never taken from sr_plans */
+	sr_plan_bypass = true;
+
+	StartTransactionCommand();
+	RestoreGUCState((char *) shared + shared->guc_offset);
+	if (shared->settings_offset != 0)
+		sr_plan_apply_settings((Jsonb *) ((char *) shared + shared->settings_offset),
+							   PGC_S_SESSION, GUC_ACTION_SET);
+	schema_oid = get_sr_plan_schema();
+	CommitTransactionCommand();
+
+	if (!OidIsValid(schema_oid))
+		proc_exit(0);
+
+	query_offsets = (Size *) ((char *) shared + shared->queries_offset);
+	for (;;)
+	{
+		uint32 i = pg_atomic_fetch_add_u32(&shared->next_query, 1);
+
+		if (i >= (uint32) shared->nqueries)
+			break;
+
+		if (!sr_plan_capture_query((char *) shared + query_offsets[i],
+								   schema_oid, mqh))
+			break;
+	}
+
+	proc_exit(0);
+}
+
+/*
+ * Plan all statements of a query string without executing them.
+ * Returns false if leader is gone.
+ */
+static bool
+sr_plan_capture_query(const char *query_string, Oid schema_oid,
+					  shm_mq_handle *mqh)
+{
+	volatile bool result = true;
+
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	pgstat_report_activity(STATE_RUNNING, query_string);
+
+	PG_TRY();
+	{
+		List	   *parsetree_list;
+		ListCell   *lc;
+
+		PushActiveSnapshot(GetTransactionSnapshot());
+
+		parsetree_list = pg_parse_query(query_string);
+		foreach(lc, parsetree_list)
+		{
+			Oid		   *paramtypes = NULL;
+			int			nparams = 0;
+			Query	   *query;
+			List	   *querytree_list;
+			ListCell   *lc2;
+
+			/*
+			 * Parameters like $1 are allowed, such plans are used for
+			 * queries sent with parameters by extended query protocol
+			 */
+			query = parse_analyze_varparams(lfirst(lc), query_string,
+											&paramtypes, &nparams);
+			querytree_list = pg_rewrite_query(query);
+
+			foreach(lc2, querytree_list)
+			{
+				Query *querytree = (Query *) lfirst(lc2);
+
+				if (querytree->commandType == CMD_UTILITY)
+					continue;
+
+				if (!sr_plan_send_plan(querytree, query_string, schema_oid, mqh))
+					result = false;
+			}
+		}
+
+		PopActiveSnapshot();
+		CommitTransactionCommand();
+	}
+	PG_CATCH();
+	{
+		/* Report the error and go on with the next query */
+		HOLD_INTERRUPTS();
+		EmitErrorReport();
+		AbortCurrentTransaction();
+		FlushErrorState();
+		RESUME_INTERRUPTS();
+	}
+	PG_END_TRY();
+
+	pgstat_report_activity(STATE_IDLE, NULL);
+
+	return result;
+}
+
+static bool
+sr_plan_send_plan(Query *query, const char *query_string,
+				  Oid schema_oid, shm_mq_handle *mqh)
+{
+	SrPlanCaptureMessage	msg;
+	PlannedStmt			   *pl_stmt;
+	Jsonb				   *plan;
+	ArrayType			   *deps;
+	Jsonb				   *template = NULL;
+	StringInfoData			buf;
+	shm_mq_result			res;
+
+	/* Hash has to be computed before planner scribbles on query */
+	msg.query_hash = sr_plan_query_hash(query, schema_oid);
+#if PG_VERSION_NUM >= 90600
+	pl_stmt = pg_plan_query(query, CURSOR_OPT_PARALLEL_OK, NULL);
+#else
+	pl_stmt = pg_plan_query(query, 0, NULL);
+#endif
+	plan = node_tree_to_jsonb(pl_stmt, 0, false);
+	msg.plan_hash = DatumGetInt32(DirectFunctionCall1(jsonb_hash, PointerGetDatum(plan)));
+	msg.shape_hash = sr_plan_shape_hash(plan);
+	deps = sr_plan_make_deps(pl_stmt->relationOids);
+	if (sr_plan_template_mode)
+	{
+		template = sr_plan_make_template(pl_stmt, sr_plan_fake_func);
+		if (template == NULL)
+		{
+			elog(LOG, "Plan depends on functions, it can't be saved as template.");
+			return true;
+		}
+	}
+	msg.query_len = strlen(query_string);
+	msg.plan_len = VARSIZE(plan);
+	msg.deps_len = VARSIZE(deps);
+	msg.template_len = template ? VARSIZE(template) : 0;
+
+	initStringInfo(&buf);
+	appendBinaryStringInfo(&buf, (char *) &msg, sizeof(msg));
+	appendBinaryStringInfo(&buf, query_string, msg.query_len);
+	appendBinaryStringInfo(&buf, (char *) plan, msg.plan_len);
+	appendBinaryStringInfo(&buf, (char *) deps, msg.deps_len);
+	if (template)
+		appendBinaryStringInfo(&buf, (char *) template, msg.template_len);
+
+	res = shm_mq_send(mqh, buf.len, buf.data, false);
+	pfree(buf.data);
+
+	return res == SHM_MQ_SUCCESS;
+}
@@ -0,0 +1,364 @@
+#include "sr_plan.h"
+#include "executor/executor.h"
+#include "executor/instrument.h"
+#include "lib/ilist.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+
+/*
+ * Stored plan used by this backend. Plan cache copies plans and another
+ * query may have the same queryId, so the plan is found by its queryId
+ * and checked by hash of its contents rather than by pointer. The same
+ * statement may come from plans of different profiles.
+ */
+typedef struct SrPlanTrackedKey
+{
+	int32		profile_hash;	/* of the session, not of the plan */
+	uint32		queryId;
+} SrPlanTrackedKey;
+
+typedef struct SrPlanTracked
+{
+	SrPlanTrackedKey key;
+	uint32		stmt_hash;
+	bool		fresh;			/* not executed since it was loaded */
+	int32		profile_hash;
+	int32		query_hash;
+	int32		plan_hash;
+} SrPlanTracked;
+
+/* Max number of tracked plans, the table is emptied when it's full */
+#define SR_PLAN_TRACKED_MAX		256
+
+/* Positions in query text don't change the plan */
+static const char *const stmt_ignored_keys[] = {
+	"stmt_location",
+	"stmt_len",
+	NULL
+};
+
+/* Execution of stored plan which is being sampled */
+typedef struct SrPlanSample
+{
+	dlist_node	node;
+	QueryDesc  *queryDesc;
+	SrPlanTracked plan;
+	bool		partial;		/* not all rows were fetched */
+	MemoryContextCallback callback;
+} SrPlanSample;
+
+static HTAB *tracked_plans = NULL;
+static dlist_head samples = DLIST_STATIC_INIT(samples);
+
+static ExecutorStart_hook_type prev_ExecutorStart = NULL;
+static ExecutorRun_hook_type prev_ExecutorRun = NULL;
+static ExecutorEnd_hook_type prev_ExecutorEnd = NULL;
+
+static void sr_plan_ExecutorStart(QueryDesc *queryDesc, int eflags);
+#if PG_VERSION_NUM >= 100000
+static void sr_plan_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction,
+								uint64 count, bool execute_once);
+#elif PG_VERSION_NUM >= 90600
+static void sr_plan_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction,
+								uint64 count);
+#else
+static void sr_plan_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction,
+								long count);
+#endif
+static void sr_plan_ExecutorEnd(QueryDesc *queryDesc);
+
+void
+sr_plan_feedback_install_hooks(void)
+{
+	prev_ExecutorStart = ExecutorStart_hook;
+	ExecutorStart_hook = sr_plan_ExecutorStart;
+	prev_ExecutorRun = ExecutorRun_hook;
+	ExecutorRun_hook = sr_plan_ExecutorRun;
+	prev_ExecutorEnd = ExecutorEnd_hook;
+	ExecutorEnd_hook = sr_plan_ExecutorEnd;
+}
+
+static void
+sr_plan_tracked_key(PlannedStmt *pl_stmt, SrPlanTrackedKey *key)
+{
+	memset(key, 0, sizeof(SrPlanTrackedKey));
+	key->profile_hash = sr_plan_profile_hash(sr_plan_profile);
+	key->queryId = pl_stmt->queryId;
+}
+
+/* Plan is serialized, so it's hashed only for sampled plans */
+static uint32
+sr_plan_stmt_hash(PlannedStmt *pl_stmt)
+{
+	return sr_plan_jsonb_hash(node_tree_to_jsonb(pl_stmt, 0, false),
+							  stmt_ignored_keys);
+}
+
+/*
+ * Remember that pl_stmt came from "sr_plans" if it's sampled. Its first
+ * execution is checked, next ones are sampled again in ExecutorStart.
+ */
+void
+sr_plan_feedback_track(PlannedStmt *pl_stmt, int32 profile_hash,
+					   int32 query_hash, int32 plan_hash)
+{
+	SrPlanTrackedKey key;
+	SrPlanTracked  *tracked;
+
+	if (sr_plan_feedback_sample_rate <= 0 ||
+		random() >= sr_plan_feedback_sample_rate * MAX_RANDOM_VALUE)
+		return;
+
+	/* Plans which are no longer executed aren't removed one by one */
+	if (tracked_plans != NULL &&
+		hash_get_num_entries(tracked_plans) >= SR_PLAN_TRACKED_MAX)
+	{
+		hash_destroy(tracked_plans);
+		tracked_plans = NULL;
+	}
+
+	if (tracked_plans == NULL)
+	{
+		HASHCTL		ctl;
+
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(SrPlanTrackedKey);
+		ctl.entrysize = sizeof(SrPlanTracked);
+		ctl.hcxt = TopMemoryContext;
+		tracked_plans = hash_create("sr_plan tracked plans", 64, &ctl,
+									HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	}
+
+	/* Without pg_stat_statements queryId isn't computed */
+	if (pl_stmt->queryId == 0)
+		pl_stmt->queryId = (uint32) query_hash;
+
+	sr_plan_tracked_key(pl_stmt, &key);
+	tracked = (SrPlanTracked *) hash_search(tracked_plans, &key,
+											HASH_ENTER, NULL);
+	tracked->stmt_hash = sr_plan_stmt_hash(pl_stmt);
+	tracked->fresh = true;
+	tracked->profile_hash = profile_hash;
+	tracked->query_hash = query_hash;
+	tracked->plan_hash = plan_hash;
+}
+
+static SrPlanSample *
+sr_plan_find_sample(QueryDesc *queryDesc)
+{
+	dlist_iter	iter;
+
+	dlist_foreach(iter, &samples)
+	{
+		SrPlanSample *sample = dlist_container(SrPlanSample, node, iter.cur);
+
+		if (sample->queryDesc == queryDesc)
+			return sample;
+	}
+
+	return NULL;
+}
+
+/* Executor state is gone, even if ExecutorEnd wasn't called due to error */
+static void
+sr_plan_forget_sample(void *arg)
+{
+	SrPlanSample *sample = (SrPlanSample *) arg;
+
+	dlist_delete(&sample->node);
+}
+
+static void
+sr_plan_ExecutorStart(QueryDesc *queryDesc, int eflags)
+{
+	SrPlanTracked *tracked = NULL;
+	SrPlanTracked	sampled;
+
+	if (sr_plan_feedback_sample_rate > 0 && tracked_plans != NULL &&
+		queryDesc->plannedstmt->queryId != 0 &&
+		(eflags & EXEC_FLAG_EXPLAIN_ONLY) == 0)
+	{
+		SrPlanTrackedKey key;
+
+		sr_plan_tracked_key(queryDesc->plannedstmt, &key);
+		tracked = (SrPlanTracked *) hash_search(tracked_plans, &key,
+												HASH_FIND, NULL);
+
+		/* Executions of cached plan are sampled like loads */
+		if (tracked && !tracked->fresh &&
+			random() >= sr_plan_feedback_sample_rate * MAX_RANDOM_VALUE)
+			tracked = NULL;
+
+		/* Another statement with the same queryId */
+		if (tracked && tracked->stmt_hash != sr_plan_stmt_hash(queryDesc->plannedstmt))
+			tracked = NULL;
+
+		if (tracked)
+		{
+			tracked->fresh = false;
+			/* Tracked plans may be forgotten by planning in ExecutorStart */
+			sampled = *tracked;
+			queryDesc->instrument_options |= INSTRUMENT_ROWS;
+		}
+	}
+
+	if (prev_ExecutorStart)
+		prev_ExecutorStart(queryDesc, eflags);
+	else
+		standard_ExecutorStart(queryDesc, eflags);
+
+	if (tracked)
+	{
+		MemoryContext	cxt = queryDesc->estate->es_query_cxt;
+		SrPlanSample   *sample;
+
+		sample = (SrPlanSample *) MemoryContextAllocZero(cxt, sizeof(SrPlanSample));
+		sample->queryDesc = queryDesc;
+		sample->plan = sampled;
+		sample->callback.func = sr_plan_forget_sample;
+		sample->callback.arg = sample;
+		MemoryContextRegisterResetCallback(cxt, &sample->callback);
+		dlist_push_head(&samples, &sample->node);
+	}
+}
+
+#if PG_VERSION_NUM >= 100000
+static void
+sr_plan_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction,
+					uint64 count, bool execute_once)
+#elif PG_VERSION_NUM >= 90600
+static void
+sr_plan_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction,
+					uint64 count)
+#else
+static void
+sr_plan_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction,
+					long count)
+#endif
+{
+	/* Row counts of partially fetched cursor are meaningless */
+	if (count != 0 && !dlist_is_empty(&samples))
+	{
+		SrPlanSample *sample = sr_plan_find_sample(queryDesc);
+
+		if (sample)
+			sample->partial = true;
+	}
+
+#if PG_VERSION_NUM >= 100000
+	if (prev_ExecutorRun)
+		prev_ExecutorRun(queryDesc, direction, count, execute_once);
+	else
+		standard_ExecutorRun(queryDesc, direction, count, execute_once);
+#else
+	if (prev_ExecutorRun)
+		prev_ExecutorRun(queryDesc, direction, count);
+	else
+		standard_ExecutorRun(queryDesc, direction, count);
+#endif
+}
+
+static void sr_plan_estimate_error(PlanState *planstate, double *error);
+
+static void
+sr_plan_estimate_error_list(PlanState **planstates, int nplans, double *error)
+{
+	int		i;
+
+	for (i = 0; i < nplans; i++)
+		sr_plan_estimate_error(planstates[i], error);
+}
+
+/*
+ * Find the worst ratio between estimated and actual rows per loop
+ * among plan nodes. Nodes which might have been stopped early
+ * (below Limit, inner side of semi and anti joins, subplans) are skipped.
+ */
+static void
+sr_plan_estimate_error(PlanState *planstate, double *error)
+{
+	Instrumentation *instr = planstate->instrument;
+	bool		skip_inner = false;
+
+	if (instr)
+	{
+		InstrEndLoop(instr);
+		if (instr->nloops > 0)
+		{
+			double	actual = Max(instr->ntuples / instr->nloops, 1.0);
+			double	estimated = Max(planstate->plan->plan_rows, 1.0);
+
+			*error = Max(*error, Max(actual / estimated, estimated / actual));
+		}
+	}
+
+	switch (nodeTag(planstate))
+	{
+		case T_LimitState:
+			return;
+		case T_NestLoopState:
+		case T_MergeJoinState:
+			skip_inner = (((JoinState *) planstate)->jointype == JOIN_SEMI ||
+						  ((JoinState *) planstate)->jointype == JOIN_ANTI);
+			break;
+		case T_AppendState:
+			sr_plan_estimate_error_list(((AppendState *) planstate)->appendplans,
+										((AppendState *) planstate)->as_nplans,
+										error);
+			break;
+		case T_MergeAppendState:
+			sr_plan_estimate_error_list(((MergeAppendState *) planstate)->mergeplans,
+										((MergeAppendState *) planstate)->ms_nplans,
+										error);
+			break;
+		case T_BitmapAndState:
+			sr_plan_estimate_error_list(((BitmapAndState *) planstate)->bitmapplans,
+										((BitmapAndState *) planstate)->nplans,
+										error);
+			break;
+		case T_BitmapOrState:
+			sr_plan_estimate_error_list(((BitmapOrState *) planstate)->bitmapplans,
+										((BitmapOrState *) planstate)->nplans,
+										error);
+			break;
+		case T_ModifyTableState:
+			sr_plan_estimate_error_list(((ModifyTableState *) planstate)->mt_plans,
+										((ModifyTableState *) planstate)->mt_nplans,
+										error);
+			break;
+		case T_SubqueryScanState:
+			sr_plan_estimate_error(((SubqueryScanState *) planstate)->subplan, error);
+			break;
+		default:
+			break;
+	}
+
+	if (outerPlanState(planstate))
+		sr_plan_estimate_error(outerPlanState(planstate), error);
+	if (innerPlanState(planstate) && !skip_inner)
+		sr_plan_estimate_error(innerPlanState(planstate), error);
+}
+
+static void
+sr_plan_ExecutorEnd(QueryDesc *queryDesc)
+{
+	SrPlanSample *sample = NULL;
+
+	if (!dlist_is_empty(&samples))
+		sample = sr_plan_find_sample(queryDesc);
+
+	if (sample && !sample->partial && queryDesc->planstate)
+	{
+		double	error = 1.0;
+
+		sr_plan_estimate_error(queryDesc->planstate, &error);
+		sr_plan_record_feedback(sample->plan.profile_hash,
+								sample->plan.query_hash,
+								sample->plan.plan_hash, error);
+	}
+
+	if (prev_ExecutorEnd)
+		prev_ExecutorEnd(queryDesc);
+	else
+		standard_ExecutorEnd(queryDesc);
+}
@@ -0,0 +1,184 @@
+#include "sr_plan.h"
+#include "access/hash.h"
+#include "utils/lsyscache.h"
+
+/*
+ * Estimates and positions in query text don't change shape of a plan,
+ * neither do Oids of relations, so that templates have the same shape
+ * in all schemas. Oids of indexes are kept: plans using different indexes
+ * of a relation are different plans.
+ */
+static const char *const shape_ignored_keys[] = {
+	"startup_cost",
+	"total_cost",
+	"per_call_cost",
+	"plan_rows",
+	"plan_width",
+	"numGroups",
+	"num_workers",
+	"rows_total",
+	"location",
+	"stmt_location",
+	"stmt_len",
+	"constvalue",
+	"queryId",
+	"relid",
+	"relationOids",
+	"resorigtbl",
+	NULL
+};
+
+/* Relations of query template are known by names only */
+static const char *const template_ignored_keys[] = {
+	"relid",
+	"resorigtbl",
+	"constraintDeps",
+	NULL
+};
+
+static bool
+sr_plan_key_ignored(JsonbValue *key, const char *const *ignored_keys)
+{
+	const char *const *k;
+
+	for (k = ignored_keys; *k != NULL; k++)
+	{
+		if (key->val.string.len == strlen(*k) &&
+			strncmp(key->val.string.val, *k, key->val.string.len) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Same as jsonb_hash(), but values of ignored keys don't affect the result.
+ * ignored_keys is a NULL-terminated array.
+ */
+uint32
+sr_plan_jsonb_hash(Jsonb *jsonb, const char *const *ignored_keys)
+{
+	JsonbIterator  *it;
+	JsonbValue		v;
+	int				type;
+	uint32			hash = 0;
+
+	it = JsonbIteratorInit(&jsonb->root);
+	while ((type = JsonbIteratorNext(&it, &v, false)) != WJB_DONE)
+	{
+		if (type == WJB_KEY && sr_plan_key_ignored(&v, ignored_keys))
+		{
+			int depth = 0;
+
+			/* Skip the value, it might be a container */
+			do
+			{
+				type = JsonbIteratorNext(&it, &v, false);
+				if (type == WJB_BEGIN_ARRAY || type == WJB_BEGIN_OBJECT)
+					depth++;
+				else if (type == WJB_END_ARRAY || type == WJB_END_OBJECT)
+					depth--;
+			} while (depth > 0 && type != WJB_DONE);
+
+			continue;
+		}
+
+		switch (type)
+		{
+			case WJB_BEGIN_ARRAY:
+				hash ^= JB_FARRAY;
+				break;
+			case WJB_BEGIN_OBJECT:
+				hash ^= JB_FOBJECT;
+				break;
+			case WJB_KEY:
+			case WJB_VALUE:
+			case WJB_ELEM:
+				JsonbHashScalarValue(&v, &hash);
+				break;
+			default:
+				break;
+		}
+	}
+
+	return hash;
+}
+
+/*
+ * Fingerprint of plan's structure: same plan with other costs
+ * and row estimates has the same shape hash.
+ */
+int32
+sr_plan_shape_hash(Jsonb *plan)
+{
+	return (int32) sr_plan_jsonb_hash(plan, shape_ignored_keys);
+}
+
+static void
+sr_plan_hash_relname(Oid relid, uint32 *hash)
+{
+	char	   *relname = get_rel_name(relid);
+
+	if (relname == NULL)
+		return;
+
+	*hash = ((*hash << 1) | (*hash >> 31)) ^
+		DatumGetUInt32(hash_any((const unsigned char *) relname, strlen(relname)));
+	pfree(relname);
+}
+
+/*
+ * Mix names of relations used by query into hash. Oids of regclass
+ * constants, e.g. of nextval('seq'), are replaced by names as well.
+ */
+static bool
+sr_plan_template_walker(Node *node, void *context)
+{
+	uint32	   *hash = (uint32 *) context;
+
+	if (node == NULL)
+		return false;
+
+	if (IsA(node, RangeTblEntry))
+	{
+		if (((RangeTblEntry *) node)->rtekind == RTE_RELATION)
+			sr_plan_hash_relname(((RangeTblEntry *) node)->relid, hash);
+		return false;
+	}
+
+	if (IsA(node, Const))
+	{
+		Const	   *con = (Const *) node;
+
+		if (con->consttype == REGCLASSOID && !con->constisnull)
+		{
+			sr_plan_hash_relname(DatumGetObjectId(con->constvalue), hash);
+			con->constvalue = ObjectIdGetDatum(InvalidOid);
+		}
+		return false;
+	}
+
+	if (IsA(node, Query))
+		return query_tree_walker((Query *) node, sr_plan_template_walker,
+								 context, QTW_EXAMINE_RTES);
+
+	return expression_tree_walker(node, sr_plan_template_walker, context);
+}
+
+/*
+ * Hash of query which is the same for queries on relations with
+ * the same names in different schemas.
+ */
+int32
+sr_plan_template_hash(Query *parse, Oid fake_func)
+{
+	uint32		hash = 0;
+
+	/* Oids of regclass constants are reset in a copy of query */
+	parse = (Query *) copyObject(parse);
+	(void) query_tree_walker(parse, sr_plan_template_walker,
+							 (void *) &hash, QTW_EXAMINE_RTES);
+
+	return (int32) (hash ^ sr_plan_jsonb_hash(node_tree_to_jsonb(parse, fake_func, true),
+											  template_ignored_keys));
+}
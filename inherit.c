@@ -0,0 +1,711 @@
+#include "sr_plan.h"
+#include "access/genam.h"
+#include "catalog/pg_class.h"
+#include "catalog/pg_inherits_fn.h"
+#include "optimizer/clauses.h"
+#include "optimizer/predtest.h"
+#include "optimizer/prep.h"
+#include "parser/parsetree.h"
+#include "rewrite/rewriteManip.h"
+#include "utils/lsyscache.h"
+#if PG_VERSION_NUM >= 100000
+#include "catalog/partition.h"
+#endif
+
+typedef struct SrPlanExpandContext
+{
+	PlannedStmt *stmt;
+	Oid			fake_func;
+	int			max_node_id;	/* for ids of cloned plan nodes */
+	bool		failed;
+} SrPlanExpandContext;
+
+typedef void (*SrPlanCallback) (Plan *plan, SrPlanExpandContext *context);
+
+static void sr_plan_walk_plans(Plan *plan, SrPlanCallback callback,
+							   SrPlanExpandContext *context);
+
+static void
+sr_plan_walk_plan_list(List *plans, SrPlanCallback callback,
+					   SrPlanExpandContext *context)
+{
+	ListCell   *lc;
+
+	foreach(lc, plans)
+		sr_plan_walk_plans((Plan *) lfirst(lc), callback, context);
+}
+
+/*
+ * Call callback for each node of plan tree, children go first.
+ */
+static void
+sr_plan_walk_plans(Plan *plan, SrPlanCallback callback,
+				   SrPlanExpandContext *context)
+{
+	if (plan == NULL)
+		return;
+
+	switch (nodeTag(plan))
+	{
+		case T_Append:
+			sr_plan_walk_plan_list(((Append *) plan)->appendplans, callback, context);
+			break;
+		case T_MergeAppend:
+			sr_plan_walk_plan_list(((MergeAppend *) plan)->mergeplans, callback, context);
+			break;
+		case T_BitmapAnd:
+			sr_plan_walk_plan_list(((BitmapAnd *) plan)->bitmapplans, callback, context);
+			break;
+		case T_BitmapOr:
+			sr_plan_walk_plan_list(((BitmapOr *) plan)->bitmapplans, callback, context);
+			break;
+		case T_ModifyTable:
+			sr_plan_walk_plan_list(((ModifyTable *) plan)->plans, callback, context);
+			break;
+		case T_SubqueryScan:
+			sr_plan_walk_plans(((SubqueryScan *) plan)->subplan, callback, context);
+			break;
+		case T_CustomScan:
+			sr_plan_walk_plan_list(((CustomScan *) plan)->custom_plans, callback, context);
+			break;
+		default:
+			break;
+	}
+
+	sr_plan_walk_plans(plan->lefttree, callback, context);
+	sr_plan_walk_plans(plan->righttree, callback, context);
+
+	callback(plan, context);
+}
+
+#if PG_VERSION_NUM >= 90600
+static void
+sr_plan_max_node_id(Plan *plan, SrPlanExpandContext *context)
+{
+	context->max_node_id = Max(context->max_node_id, plan->plan_node_id);
+}
+#endif
+
+/*
+ * Check that bitmap subtree consists only of index scans of rti.
+ */
+static bool
+sr_plan_bitmap_scans(Plan *plan, Index rti)
+{
+	List	   *plans;
+	ListCell   *lc;
+
+	if (IsA(plan, BitmapIndexScan))
+		return ((BitmapIndexScan *) plan)->scan.scanrelid == rti;
+
+	if (IsA(plan, BitmapAnd))
+		plans = ((BitmapAnd *) plan)->bitmapplans;
+	else if (IsA(plan, BitmapOr))
+		plans = ((BitmapOr *) plan)->bitmapplans;
+	else
+		return false;
+
+	foreach(lc, plans)
+	{
+		if (!sr_plan_bitmap_scans((Plan *) lfirst(lc), rti))
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Find the scan of child relation in Append subplan. NULL if the subplan
+ * is something more complex than a (sorted or projected) relation scan.
+ */
+static Scan *
+sr_plan_child_scan(Plan *plan)
+{
+	while (plan != NULL &&
+		   (IsA(plan, Result) || IsA(plan, Sort) || IsA(plan, Material)))
+	{
+		if (plan->righttree != NULL)
+			return NULL;
+		plan = plan->lefttree;
+	}
+
+	if (plan == NULL || plan->initPlan != NIL)
+		return NULL;
+
+	switch (nodeTag(plan))
+	{
+		case T_SeqScan:
+		case T_IndexScan:
+		case T_IndexOnlyScan:
+			return (Scan *) plan;
+		case T_BitmapHeapScan:
+			if (plan->lefttree == NULL ||
+				!sr_plan_bitmap_scans(plan->lefttree, ((Scan *) plan)->scanrelid))
+				return NULL;
+			return (Scan *) plan;
+		default:
+			return NULL;
+	}
+}
+
+/*
+ * Check that relations have the same columns with the same attnos:
+ * Vars of cloned scan keep attnos of the pattern child.
+ */
+static bool
+sr_plan_same_rowtype(TupleDesc a, TupleDesc b)
+{
+	int		i;
+
+	if (a->natts != b->natts)
+		return false;
+
+	for (i = 0; i < a->natts; i++)
+	{
+		Form_pg_attribute	atta = a->attrs[i];
+		Form_pg_attribute	attb = b->attrs[i];
+
+		if (atta->attnum != attb->attnum ||
+			atta->attisdropped != attb->attisdropped)
+			return false;
+		if (atta->attisdropped)
+			continue;
+		if (atta->atttypid != attb->atttypid ||
+			atta->atttypmod != attb->atttypmod ||
+			atta->attcollation != attb->attcollation ||
+			strcmp(NameStr(atta->attname), NameStr(attb->attname)) != 0)
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Find index of rel which is the same as index indexid of another relation
+ * with the same row type, InvalidOid if there is no such index.
+ */
+static Oid
+sr_plan_matching_index(Oid indexid, Relation rel)
+{
+	Relation	pattern;
+	List	   *indexes;
+	ListCell   *lc;
+	Oid			result = InvalidOid;
+
+	pattern = index_open(indexid, AccessShareLock);
+	indexes = RelationGetIndexList(rel);
+
+	foreach(lc, indexes)
+	{
+		Relation	index = index_open(lfirst_oid(lc), AccessShareLock);
+		int			natts = pattern->rd_index->indnatts;
+		int			i;
+		bool		match;
+
+		match = (IndexIsValid(index->rd_index) &&
+				 index->rd_rel->relam == pattern->rd_rel->relam &&
+				 index->rd_index->indnatts == natts);
+
+		for (i = 0; match && i < natts; i++)
+		{
+			match = (index->rd_index->indkey.values[i] == pattern->rd_index->indkey.values[i] &&
+					 index->rd_opfamily[i] == pattern->rd_opfamily[i] &&
+					 index->rd_indcollation[i] == pattern->rd_indcollation[i] &&
+					 index->rd_indoption[i] == pattern->rd_indoption[i]);
+		}
+
+		match = (match &&
+				 equal(RelationGetIndexExpressions(index),
+					   RelationGetIndexExpressions(pattern)) &&
+				 equal(RelationGetIndexPredicate(index),
+					   RelationGetIndexPredicate(pattern)));
+
+		index_close(index, NoLock);
+
+		if (match)
+		{
+			result = lfirst_oid(lc);
+			break;
+		}
+	}
+
+	list_free(indexes);
+	index_close(pattern, NoLock);
+
+	return result;
+}
+
+typedef struct SrPlanWholeRow
+{
+	Index		rti;
+} SrPlanWholeRow;
+
+static bool
+sr_plan_has_whole_row(Node *node, SrPlanWholeRow *context)
+{
+	if (node == NULL)
+		return false;
+
+	if (IsA(node, Var))
+		return (((Var *) node)->varno == context->rti &&
+				((Var *) node)->varattno == 0 &&
+				((Var *) node)->varlevelsup == 0);
+
+	return expression_tree_walker(node, sr_plan_has_whole_row, (void *) context);
+}
+
+/*
+ * Make scan of relation relid from another child of the same Append.
+ * Expressions are copied, only their Vars are moved to the new relation.
+ * Returns false if the child can't be made the same way.
+ */
+static bool
+sr_plan_clone_node(Plan *plan, Index old_rti, Index new_rti, Relation rel,
+				   SrPlanExpandContext *context)
+{
+	SrPlanWholeRow	whole_row;
+
+	if (plan == NULL)
+		return true;
+
+	whole_row.rti = old_rti;
+	if (sr_plan_has_whole_row((Node *) plan->targetlist, &whole_row) ||
+		sr_plan_has_whole_row((Node *) plan->qual, &whole_row) ||
+		contain_subplans((Node *) plan->targetlist) ||
+		contain_subplans((Node *) plan->qual))
+		return false;
+
+	ChangeVarNodes((Node *) plan->targetlist, old_rti, new_rti, 0);
+	ChangeVarNodes((Node *) plan->qual, old_rti, new_rti, 0);
+#if PG_VERSION_NUM >= 90600
+	plan->plan_node_id = ++context->max_node_id;
+#endif
+
+	switch (nodeTag(plan))
+	{
+		case T_SeqScan:
+			((Scan *) plan)->scanrelid = new_rti;
+			break;
+		case T_IndexScan:
+			{
+				IndexScan  *scan = (IndexScan *) plan;
+
+				scan->scan.scanrelid = new_rti;
+				scan->indexid = sr_plan_matching_index(scan->indexid, rel);
+				if (!OidIsValid(scan->indexid))
+					return false;
+				ChangeVarNodes((Node *) scan->indexqual, old_rti, new_rti, 0);
+				ChangeVarNodes((Node *) scan->indexqualorig, old_rti, new_rti, 0);
+				ChangeVarNodes((Node *) scan->indexorderby, old_rti, new_rti, 0);
+				ChangeVarNodes((Node *) scan->indexorderbyorig, old_rti, new_rti, 0);
+			}
+			break;
+		case T_IndexOnlyScan:
+			{
+				IndexOnlyScan *scan = (IndexOnlyScan *) plan;
+
+				scan->scan.scanrelid = new_rti;
+				scan->indexid = sr_plan_matching_index(scan->indexid, rel);
+				if (!OidIsValid(scan->indexid))
+					return false;
+				ChangeVarNodes((Node *) scan->indexqual, old_rti, new_rti, 0);
+				ChangeVarNodes((Node *) scan->indexorderby, old_rti, new_rti, 0);
+				ChangeVarNodes((Node *) scan->indextlist, old_rti, new_rti, 0);
+			}
+			break;
+		case T_BitmapIndexScan:
+			{
+				BitmapIndexScan *scan = (BitmapIndexScan *) plan;
+
+				scan->scan.scanrelid = new_rti;
+				scan->indexid = sr_plan_matching_index(scan->indexid, rel);
+				if (!OidIsValid(scan->indexid))
+					return false;
+				ChangeVarNodes((Node *) scan->indexqual, old_rti, new_rti, 0);
+				ChangeVarNodes((Node *) scan->indexqualorig, old_rti, new_rti, 0);
+			}
+			break;
+		case T_BitmapHeapScan:
+			((Scan *) plan)->scanrelid = new_rti;
+			ChangeVarNodes((Node *) ((BitmapHeapScan *) plan)->bitmapqualorig,
+						   old_rti, new_rti, 0);
+			break;
+		case T_BitmapAnd:
+			{
+				ListCell   *lc;
+
+				foreach(lc, ((BitmapAnd *) plan)->bitmapplans)
+					if (!sr_plan_clone_node((Plan *) lfirst(lc), old_rti, new_rti,
+											rel, context))
+						return false;
+			}
+			break;
+		case T_BitmapOr:
+			{
+				ListCell   *lc;
+
+				foreach(lc, ((BitmapOr *) plan)->bitmapplans)
+					if (!sr_plan_clone_node((Plan *) lfirst(lc), old_rti, new_rti,
+											rel, context))
+						return false;
+			}
+			break;
+		case T_Result:
+			ChangeVarNodes(((Result *) plan)->resconstantqual, old_rti, new_rti, 0);
+			break;
+		default:
+			break;
+	}
+
+	return (sr_plan_clone_node(plan->lefttree, old_rti, new_rti, rel, context) &&
+			sr_plan_clone_node(plan->righttree, old_rti, new_rti, rel, context));
+}
+
+static Plan *
+sr_plan_clone_child(Plan *pattern, Index pattern_rti, Oid relid,
+					SrPlanExpandContext *context)
+{
+	PlannedStmt	   *stmt = context->stmt;
+	RangeTblEntry  *pattern_rte = rt_fetch(pattern_rti, stmt->rtable);
+	RangeTblEntry  *rte;
+	Relation		pattern_rel;
+	Relation		rel;
+	Plan		   *plan = NULL;
+	bool			ok;
+
+	pattern_rel = heap_open(pattern_rte->relid, AccessShareLock);
+	rel = heap_open(relid, AccessShareLock);
+
+	ok = (rel->rd_rel->relkind == RELKIND_RELATION &&
+		  sr_plan_same_rowtype(RelationGetDescr(pattern_rel), RelationGetDescr(rel)));
+
+	if (ok)
+	{
+		rte = (RangeTblEntry *) copyObject(pattern_rte);
+		rte->relid = relid;
+		stmt->rtable = lappend(stmt->rtable, rte);
+
+		plan = (Plan *) copyObject(pattern);
+		ok = sr_plan_clone_node(plan, pattern_rti, list_length(stmt->rtable),
+								rel, context);
+	}
+
+	heap_close(rel, NoLock);
+	heap_close(pattern_rel, NoLock);
+
+	if (!ok)
+		return NULL;
+
+	stmt->relationOids = lappend_oid(stmt->relationOids, relid);
+
+	return plan;
+}
+
+/*
+ * Replace _p() by its argument, so that the value can be used for pruning.
+ */
+static Node *
+sr_plan_strip_fake(Node *node, Oid *fake_func)
+{
+	if (node == NULL)
+		return NULL;
+
+	if (IsA(node, FuncExpr) && ((FuncExpr *) node)->funcid == *fake_func)
+		return sr_plan_strip_fake((Node *) linitial(((FuncExpr *) node)->args),
+								  fake_func);
+
+	return expression_tree_mutator(node, sr_plan_strip_fake, (void *) fake_func);
+}
+
+/*
+ * Constraints of child relation, like get_relation_constraints() does.
+ */
+static List *
+sr_plan_child_constraints(Oid relid, Index rti)
+{
+	Relation	rel;
+	TupleConstr *constr;
+	List	   *result = NIL;
+	int			i;
+
+	rel = heap_open(relid, NoLock);
+	constr = rel->rd_att->constr;
+
+	for (i = 0; constr != NULL && i < constr->num_check; i++)
+	{
+		Node	   *cexpr;
+
+		if (!constr->check[i].ccvalid)
+			continue;
+
+		cexpr = stringToNode(constr->check[i].ccbin);
+		cexpr = eval_const_expressions(NULL, cexpr);
+		cexpr = (Node *) canonicalize_qual((Expr *) cexpr);
+		ChangeVarNodes(cexpr, 1, rti, 0);
+		result = list_concat(result, make_ands_implicit((Expr *) cexpr));
+	}
+
+#if PG_VERSION_NUM >= 100000
+	if (rel->rd_rel->relispartition)
+	{
+		List	   *pcqual = RelationGetPartitionQual(rel);
+
+		if (pcqual != NIL)
+		{
+			pcqual = (List *) eval_const_expressions(NULL, (Node *) pcqual);
+			ChangeVarNodes((Node *) pcqual, 1, rti, 0);
+			result = list_concat(result, pcqual);
+		}
+	}
+#endif
+
+	heap_close(rel, NoLock);
+
+	return result;
+}
+
+/*
+ * Check if child can't have rows matching values of _p() of this query.
+ */
+static bool
+sr_plan_child_excluded(Plan *child, SrPlanExpandContext *context)
+{
+	Scan	   *scan = sr_plan_child_scan(child);
+	List	   *quals = NIL;
+	List	   *clauses = NIL;
+	List	   *constraints;
+	ListCell   *lc;
+
+	switch (nodeTag(scan))
+	{
+		case T_IndexScan:
+			quals = list_concat(list_copy(((IndexScan *) scan)->indexqualorig),
+								scan->plan.qual);
+			break;
+		case T_BitmapHeapScan:
+			quals = list_concat(list_copy(((BitmapHeapScan *) scan)->bitmapqualorig),
+								scan->plan.qual);
+			break;
+		case T_IndexOnlyScan:
+			/* Quals reference the index, not the relation */
+			return false;
+		default:
+			quals = scan->plan.qual;
+			break;
+	}
+
+	foreach(lc, quals)
+	{
+		Node	   *clause = sr_plan_strip_fake((Node *) lfirst(lc), &context->fake_func);
+
+		if (!contain_mutable_functions(clause))
+			clauses = lappend(clauses, clause);
+	}
+
+	if (clauses == NIL)
+		return false;
+
+	constraints = sr_plan_child_constraints(rt_fetch(scan->scanrelid,
+													 context->stmt->rtable)->relid,
+											scan->scanrelid);
+	if (constraints == NIL)
+		return false;
+
+#if PG_VERSION_NUM >= 100000
+	return predicate_refuted_by(constraints, clauses, false);
+#else
+	return predicate_refuted_by(constraints, clauses);
+#endif
+}
+
+/*
+ * Rebuild children of Append from the current children of the parent table.
+ * Existing children are kept, a new one is made like the first child of the
+ * saved plan, children of detached tables are removed.
+ */
+static List *
+sr_plan_expand_children(List *children, SrPlanExpandContext *context)
+{
+	PlannedStmt	   *stmt = context->stmt;
+	RangeTblEntry  *parent = NULL;
+	List		   *inheritors = NIL;
+	List		   *old_relids = NIL;
+	List		   *old_rtis = NIL;
+	List		   *result = NIL;
+	Plan		   *pattern = NULL;
+	Index			pattern_rti = 0;
+	ListCell	   *lc;
+	ListCell	   *rlc;
+
+	if (children == NIL)
+		return children;
+
+	foreach(lc, children)
+	{
+		Scan   *scan = sr_plan_child_scan((Plan *) lfirst(lc));
+
+		/* Some child isn't a plain scan, keep Append as it is */
+		if (scan == NULL || scan->scanrelid == 0)
+			return children;
+		old_rtis = lappend_int(old_rtis, scan->scanrelid);
+		old_relids = lappend_oid(old_relids,
+								 rt_fetch(scan->scanrelid, stmt->rtable)->relid);
+	}
+
+	/* Parent table is the one whose children are scanned */
+	foreach(rlc, stmt->rtable)
+	{
+		RangeTblEntry  *rte = (RangeTblEntry *) lfirst(rlc);
+
+		if (rte->rtekind != RTE_RELATION || !rte->inh)
+			continue;
+
+		inheritors = find_all_inheritors(rte->relid, AccessShareLock, NULL);
+		foreach(lc, old_relids)
+		{
+			if (lfirst_oid(lc) != rte->relid && list_member_oid(inheritors, lfirst_oid(lc)))
+			{
+				parent = rte;
+				break;
+			}
+		}
+		if (parent != NULL)
+			break;
+		list_free(inheritors);
+	}
+
+	/* Not an inheritance Append (e.g. UNION ALL) */
+	if (parent == NULL)
+		return children;
+
+	/*
+	 * Children of inheritance are copies of the parent entry without
+	 * permissions to check, anything else is mixed in by UNION ALL.
+	 */
+	foreach(lc, old_rtis)
+	{
+		RangeTblEntry  *rte = rt_fetch(lfirst_int(lc), stmt->rtable);
+		int				n = 0;
+
+		foreach(rlc, old_relids)
+			n += (lfirst_oid(rlc) == rte->relid);
+
+		if (n > 1 ||
+			strcmp(rte->eref->aliasname, parent->eref->aliasname) != 0 ||
+			(rte->relid != parent->relid && rte->requiredPerms != 0))
+			return children;
+	}
+
+	forboth(lc, children, rlc, old_relids)
+	{
+		if (lfirst_oid(rlc) != parent->relid)
+		{
+			pattern = (Plan *) lfirst(lc);
+			pattern_rti = sr_plan_child_scan(pattern)->scanrelid;
+			break;
+		}
+	}
+
+	foreach(rlc, inheritors)
+	{
+		Oid		relid = lfirst_oid(rlc);
+		Plan   *child = NULL;
+		int		i = 0;
+
+		foreach(lc, old_relids)
+		{
+			if (lfirst_oid(lc) == relid)
+			{
+				child = (Plan *) list_nth(children, i);
+				break;
+			}
+			i++;
+		}
+
+		if (child == NULL)
+		{
+#if PG_VERSION_NUM >= 100000
+			/* Partitioned tables have no rows, their partitions are scanned */
+			if (get_rel_relkind(relid) == RELKIND_PARTITIONED_TABLE)
+				continue;
+#endif
+			if (pattern != NULL)
+				child = sr_plan_clone_child(pattern, pattern_rti, relid, context);
+			if (child == NULL)
+			{
+				context->failed = true;
+				return children;
+			}
+		}
+
+		result = lappend(result, child);
+	}
+
+	/* Detached tables aren't used by the plan anymore */
+	foreach(lc, old_relids)
+	{
+		if (!list_member_oid(inheritors, lfirst_oid(lc)))
+		{
+			while (list_member_oid(stmt->relationOids, lfirst_oid(lc)))
+				stmt->relationOids = list_delete_oid(stmt->relationOids,
+													 lfirst_oid(lc));
+		}
+	}
+
+	/* Prune children by values of this query, at least one is kept */
+	children = result;
+	result = NIL;
+	foreach(lc, children)
+	{
+		if (!sr_plan_child_excluded((Plan *) lfirst(lc), context))
+			result = lappend(result, lfirst(lc));
+	}
+	if (result == NIL)
+		result = list_make1(linitial(children));
+
+	return result;
+}
+
+static void
+sr_plan_expand_append(Plan *plan, SrPlanExpandContext *context)
+{
+	if (context->failed)
+		return;
+
+	if (IsA(plan, Append))
+		((Append *) plan)->appendplans =
+			sr_plan_expand_children(((Append *) plan)->appendplans, context);
+	else if (IsA(plan, MergeAppend))
+		((MergeAppend *) plan)->mergeplans =
+			sr_plan_expand_children(((MergeAppend *) plan)->mergeplans, context);
+}
+
+/*
+ * Make Append nodes of saved plan scan the current children of inherited
+ * and partitioned tables. Only SELECT plans with plain scans of children
+ * are rebuilt, others are used as they are. Returns false if a new child
+ * can't be scanned like the others, then the query has to be planned.
+ */
+bool
+sr_plan_expand_inheritance(PlannedStmt *pl_stmt, Oid fake_func)
+{
+	SrPlanExpandContext context;
+
+	if (pl_stmt->commandType != CMD_SELECT || pl_stmt->rowMarks != NIL)
+		return true;
+
+	context.stmt = pl_stmt;
+	context.fake_func = fake_func;
+	context.max_node_id = 0;
+	context.failed = false;
+
+#if PG_VERSION_NUM >= 90600
+	sr_plan_walk_plans(pl_stmt->planTree, sr_plan_max_node_id, &context);
+	sr_plan_walk_plan_list(pl_stmt->subplans, sr_plan_max_node_id, &context);
+#endif
+
+	sr_plan_walk_plans(pl_stmt->planTree, sr_plan_expand_append, &context);
+	sr_plan_walk_plan_list(pl_stmt->subplans, sr_plan_expand_append, &context);
+
+	return !context.failed;
+}
@@ -0,0 +1,182 @@
+#include "sr_plan.h"
+#include "miscadmin.h"
+#include "utils/guc_tables.h"
+
+/*
+ * Settings which are saved with plans and replayed: planner methods,
+ * costs, GEQO and other query tuning settings, and work_mem.
+ */
+static bool
+sr_plan_planner_setting(struct config_generic *conf)
+{
+	if (conf->context != PGC_USERSET || (conf->flags & GUC_NO_SHOW_ALL))
+		return false;
+
+	return (conf->group == QUERY_TUNING_METHOD ||
+			conf->group == QUERY_TUNING_COST ||
+			conf->group == QUERY_TUNING_GEQO ||
+			conf->group == QUERY_TUNING_OTHER ||
+			strcmp(conf->name, "work_mem") == 0);
+}
+
+static struct config_generic *
+sr_plan_find_setting(const char *name)
+{
+	struct config_generic **gucs = get_guc_variables();
+	int				ngucs = GetNumConfigOptions();
+	int				i;
+
+	for (i = 0; i < ngucs; i++)
+	{
+		if (pg_strcasecmp(gucs[i]->name, name) == 0)
+			return gucs[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * Set planner settings given as jsonb object {"name": value, ...},
+ * only check them if changeVal is false. Settings which are not
+ * planner settings are refused. Returns false if some setting
+ * is refused and elevel is lower than ERROR.
+ */
+static bool
+sr_plan_set_settings(Jsonb *settings, GucSource source, GucAction action,
+					 bool changeVal, int elevel)
+{
+	JsonbIterator  *it;
+	JsonbValue		v;
+	int				type;
+	char		   *name = NULL;
+	bool			result = true;
+
+	if (settings == NULL)
+		return true;
+
+	if (!JB_ROOT_IS_OBJECT(settings))
+	{
+		ereport(elevel,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("planner settings must be a jsonb object")));
+		return false;
+	}
+
+	it = JsonbIteratorInit(&settings->root);
+	while ((type = JsonbIteratorNext(&it, &v, true)) != WJB_DONE)
+	{
+		struct config_generic *conf;
+		char *value;
+
+		if (type == WJB_KEY)
+		{
+			name = pnstrdup(v.val.string.val, v.val.string.len);
+			continue;
+		}
+
+		if (type != WJB_VALUE)
+			continue;
+
+		conf = sr_plan_find_setting(name);
+		if (conf == NULL || !sr_plan_planner_setting(conf))
+		{
+			ereport(elevel,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("\"%s\" is not a planner setting", name)));
+			result = false;
+			continue;
+		}
+
+		switch (v.type)
+		{
+			case jbvString:
+				value = pnstrdup(v.val.string.val, v.val.string.len);
+				break;
+			case jbvNumeric:
+				value = DatumGetCString(DirectFunctionCall1(numeric_out,
+										NumericGetDatum(v.val.numeric)));
+				break;
+			case jbvBool:
+				value = v.val.boolean ? "on" : "off";
+				break;
+			default:
+				ereport(elevel,
+						(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						 errmsg("invalid value of planner setting \"%s\"", name)));
+				result = false;
+				continue;
+		}
+
+		if (set_config_option(name, value, PGC_USERSET, source,
+							  action, changeVal, elevel, false) <= 0)
+			result = false;
+	}
+
+	return result;
+}
+
+/*
+ * Apply planner settings, e.g. saved with a plan. Failures are reported
+ * as warnings, false is returned then.
+ */
+bool
+sr_plan_apply_settings(Jsonb *settings, GucSource source, GucAction action)
+{
+	return sr_plan_set_settings(settings, source, action, true, WARNING);
+}
+
+/*
+ * Check planner settings given by user before they are applied elsewhere.
+ */
+void
+sr_plan_check_settings(Jsonb *settings)
+{
+	(void) sr_plan_set_settings(settings, PGC_S_SESSION, GUC_ACTION_SET,
+								false, ERROR);
+}
+
+/*
+ * Planner settings of the session which differ from defaults,
+ * as jsonb object {"name": "value", ...}. NULL if there're none.
+ * Only planner settings which any user can change are collected,
+ * so that they can be applied by sr_plan_apply_settings().
+ */
+Jsonb *
+sr_plan_current_settings(void)
+{
+	struct config_generic **gucs = get_guc_variables();
+	int				ngucs = GetNumConfigOptions();
+	JsonbParseState *state = NULL;
+	JsonbValue	   *result;
+	JsonbValue		v;
+	int				nsettings = 0;
+	int				i;
+
+	pushJsonbValue(&state, WJB_BEGIN_OBJECT, NULL);
+	for (i = 0; i < ngucs; i++)
+	{
+		struct config_generic *conf = gucs[i];
+		char	   *value;
+
+		if (conf->source <= PGC_S_DYNAMIC_DEFAULT ||
+			!sr_plan_planner_setting(conf))
+			continue;
+
+		v.type = jbvString;
+		v.val.string.val = (char *) conf->name;
+		v.val.string.len = strlen(conf->name);
+		pushJsonbValue(&state, WJB_KEY, &v);
+
+		value = pstrdup(GetConfigOption(conf->name, false, false));
+		v.val.string.val = value;
+		v.val.string.len = strlen(value);
+		pushJsonbValue(&state, WJB_VALUE, &v);
+		nsettings++;
+	}
+	result = pushJsonbValue(&state, WJB_END_OBJECT, NULL);
+
+	if (nsettings == 0)
+		return NULL;
+
+	return JsonbValueToJsonb(result);
+}
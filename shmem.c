@@ -0,0 +1,362 @@
+#include "sr_plan.h"
+#include "access/hash.h"
+#include "access/transam.h"
+#include "access/xact.h"
+#include "miscadmin.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/hsearch.h"
+
+typedef struct SrPlanSharedState
+{
+	LWLock	   *lock;			/* protects stats hashtable search/modification */
+	LWLock	   *spool_lock;		/* serializes writes of spool file */
+	uint32		spool_generation;	/* number of spool resets, under spool_lock */
+} SrPlanSharedState;
+
+static SrPlanSharedState *sr_plan_state = NULL;
+static HTAB *sr_plan_stats = NULL;
+
+static shmem_startup_hook_type shmem_startup_hook_next = NULL;
+
+static Size sr_plan_shmem_size(void);
+static void sr_plan_shmem_startup(void);
+
+static Size
+sr_plan_shmem_size(void)
+{
+	Size		size;
+
+	size = MAXALIGN(sizeof(SrPlanSharedState));
+	size = add_size(size, hash_estimate_size(SR_PLAN_STATS_MAX,
+											 sizeof(SrPlanStatsEntry)));
+
+	return size;
+}
+
+/*
+ * Reserve shared memory and locks. Must be called from _PG_init()
+ * while shared_preload_libraries are being loaded.
+ */
+void
+sr_plan_shmem_request(void)
+{
+	RequestAddinShmemSpace(sr_plan_shmem_size());
+#if PG_VERSION_NUM >= 90600
+	RequestNamedLWLockTranche("sr_plan", 2);
+#else
+	RequestAddinLWLocks(2);
+#endif
+
+	shmem_startup_hook_next = shmem_startup_hook;
+	shmem_startup_hook = sr_plan_shmem_startup;
+}
+
+static void
+sr_plan_shmem_startup(void)
+{
+	bool		found;
+	HASHCTL		info;
+
+	if (shmem_startup_hook_next)
+		shmem_startup_hook_next();
+
+	sr_plan_state = NULL;
+	sr_plan_stats = NULL;
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	sr_plan_state = ShmemInitStruct("sr_plan",
+									sizeof(SrPlanSharedState),
+									&found);
+	if (!found)
+	{
+#if PG_VERSION_NUM >= 90600
+		LWLockPadded *locks = GetNamedLWLockTranche("sr_plan");
+
+		sr_plan_state->lock = &locks[0].lock;
+		sr_plan_state->spool_lock = &locks[1].lock;
+#else
+		sr_plan_state->lock = LWLockAssign();
+		sr_plan_state->spool_lock = LWLockAssign();
+#endif
+		sr_plan_state->spool_generation = 0;
+	}
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(SrPlanStatsKey);
+	info.entrysize = sizeof(SrPlanStatsEntry);
+	sr_plan_stats = ShmemInitHash("sr_plan stats",
+								  SR_PLAN_STATS_MAX, SR_PLAN_STATS_MAX,
+								  &info,
+								  HASH_ELEM | HASH_BLOBS);
+
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * Lock of spool file, NULL if sr_plan isn't in shared_preload_libraries.
+ */
+LWLock *
+sr_plan_spool_lock(void)
+{
+	return sr_plan_state ? sr_plan_state->spool_lock : NULL;
+}
+
+/*
+ * Backends forget plans they have spooled when the spool file is reset.
+ */
+uint32
+sr_plan_spool_generation(void)
+{
+	return sr_plan_state ? sr_plan_state->spool_generation : 0;
+}
+
+/*
+ * Called under spool lock when spool file is removed.
+ */
+void
+sr_plan_spool_next_generation(void)
+{
+	if (sr_plan_state)
+		sr_plan_state->spool_generation++;
+}
+
+/*
+ * Hash of profile name, the same as hashtext(profile) in SQL.
+ */
+int32
+sr_plan_profile_hash(const char *profile)
+{
+	return DatumGetInt32(hash_any((const unsigned char *) profile, strlen(profile)));
+}
+
+/*
+ * Find or create entry of the plan, shared lock must be held.
+ * Returns NULL with the lock released if the table is full.
+ */
+static SrPlanStatsEntry *
+sr_plan_stats_entry(int32 profile_hash, int32 query_hash, int32 plan_hash)
+{
+	SrPlanStatsKey		key;
+	SrPlanStatsEntry   *entry;
+
+	memset(&key, 0, sizeof(key));
+	key.database_id = MyDatabaseId;
+	key.profile_hash = profile_hash;
+	key.query_hash = query_hash;
+	key.plan_hash = plan_hash;
+
+	entry = (SrPlanStatsEntry *) hash_search(sr_plan_stats, &key, HASH_FIND, NULL);
+	if (!entry)
+	{
+		bool	found;
+
+		/* Need exclusive lock to make a new hashtable entry */
+		LWLockRelease(sr_plan_state->lock);
+		LWLockAcquire(sr_plan_state->lock, LW_EXCLUSIVE);
+
+		entry = (SrPlanStatsEntry *) hash_search(sr_plan_stats, &key,
+												 HASH_ENTER_NULL, &found);
+		if (!entry)
+		{
+			LWLockRelease(sr_plan_state->lock);
+			return NULL;
+		}
+
+		if (!found)
+		{
+			SpinLockInit(&entry->mutex);
+			entry->hits = 0;
+			entry->last_hit = 0;
+			entry->bad_samples = 0;
+			entry->max_error = 0;
+			entry->disabled = false;
+			entry->flush_xid = InvalidTransactionId;
+		}
+	}
+
+	return entry;
+}
+
+/*
+ * Count a hit of stored plan. Counters are kept in shared memory
+ * and written into "sr_plans" by maintenance, so that plan lookup
+ * never has to update the table.
+ */
+void
+sr_plan_record_hit(int32 profile_hash, int32 query_hash, int32 plan_hash)
+{
+	SrPlanStatsEntry   *entry;
+	TimestampTz			now;
+
+	/* Shared memory is available only if we're in shared_preload_libraries */
+	if (!sr_plan_state || !sr_plan_stats)
+		return;
+
+	now = GetCurrentTimestamp();
+
+	LWLockAcquire(sr_plan_state->lock, LW_SHARED);
+
+	/* Table is full, this hit will be lost */
+	entry = sr_plan_stats_entry(profile_hash, query_hash, plan_hash);
+	if (!entry)
+		return;
+
+	SpinLockAcquire(&entry->mutex);
+	entry->hits++;
+	if (entry->last_hit < now)
+		entry->last_hit = now;
+	SpinLockRelease(&entry->mutex);
+
+	LWLockRelease(sr_plan_state->lock);
+}
+
+/*
+ * Account a sampled execution of stored plan, error is the worst ratio
+ * between estimated and actual rows of plan nodes. Plan is disabled
+ * for all backends after sr_plan.feedback_min_samples bad executions in a row.
+ */
+void
+sr_plan_record_feedback(int32 profile_hash, int32 query_hash, int32 plan_hash,
+						double error)
+{
+	SrPlanStatsEntry   *entry;
+	bool				disabled = false;
+
+	if (!sr_plan_state || !sr_plan_stats)
+		return;
+
+	LWLockAcquire(sr_plan_state->lock, LW_SHARED);
+
+	entry = sr_plan_stats_entry(profile_hash, query_hash, plan_hash);
+	if (!entry)
+		return;
+
+	SpinLockAcquire(&entry->mutex);
+	if (error >= sr_plan_feedback_threshold)
+	{
+		entry->bad_samples++;
+		entry->max_error = Max(entry->max_error, error);
+		if (!entry->disabled &&
+			entry->bad_samples >= sr_plan_feedback_min_samples)
+		{
+			entry->disabled = true;
+			disabled = true;
+		}
+	}
+	else if (!entry->disabled)
+	{
+		entry->bad_samples = 0;
+		entry->max_error = 0;
+	}
+	SpinLockRelease(&entry->mutex);
+
+	LWLockRelease(sr_plan_state->lock);
+
+	if (disabled)
+		elog(LOG, "Saved plan of query %d is disabled, rows were misestimated by factor of %.0f.",
+			 query_hash, error);
+}
+
+/*
+ * Check if stored plan was disabled by executor feedback.
+ */
+bool
+sr_plan_is_disabled(int32 profile_hash, int32 query_hash, int32 plan_hash)
+{
+	SrPlanStatsKey		key;
+	SrPlanStatsEntry   *entry;
+	bool				disabled = false;
+
+	if (!sr_plan_state || !sr_plan_stats)
+		return false;
+
+	memset(&key, 0, sizeof(key));
+	key.database_id = MyDatabaseId;
+	key.profile_hash = profile_hash;
+	key.query_hash = query_hash;
+	key.plan_hash = plan_hash;
+
+	LWLockAcquire(sr_plan_state->lock, LW_SHARED);
+
+	entry = (SrPlanStatsEntry *) hash_search(sr_plan_stats, &key, HASH_FIND, NULL);
+	if (entry)
+	{
+		SpinLockAcquire(&entry->mutex);
+		disabled = entry->disabled;
+		SpinLockRelease(&entry->mutex);
+	}
+
+	LWLockRelease(sr_plan_state->lock);
+
+	return disabled;
+}
+
+/*
+ * Return a palloc'd copy of pending hit counters of the current database
+ * and reset them.
+ * Entries of plans which are being sampled by feedback are kept.
+ * Disabled plans are kept until the transaction which writes them
+ * into "sr_plans" commits, they are returned again if it has aborted.
+ */
+SrPlanStatsEntry *
+sr_plan_drain_stats(int *nentries)
+{
+	HASH_SEQ_STATUS		status;
+	SrPlanStatsEntry   *entry;
+	SrPlanStatsEntry   *result;
+	TransactionId		xid;
+	int					n = 0;
+
+	*nentries = 0;
+	if (!sr_plan_state || !sr_plan_stats)
+		return NULL;
+
+	/* Assigning xid may wait, it's done before planning backends are blocked */
+	xid = GetCurrentTransactionId();
+
+	LWLockAcquire(sr_plan_state->lock, LW_EXCLUSIVE);
+
+	result = (SrPlanStatsEntry *)
+		palloc(Max(hash_get_num_entries(sr_plan_stats), 1) * sizeof(SrPlanStatsEntry));
+
+	hash_seq_init(&status, sr_plan_stats);
+	while ((entry = (SrPlanStatsEntry *) hash_seq_search(&status)) != NULL)
+	{
+		/* Other databases flush their own entries */
+		if (entry->key.database_id != MyDatabaseId)
+			continue;
+
+		if (entry->disabled)
+		{
+			if (TransactionIdIsValid(entry->flush_xid) &&
+				TransactionIdDidCommit(entry->flush_xid))
+			{
+				hash_search(sr_plan_stats, &entry->key, HASH_REMOVE, NULL);
+				continue;
+			}
+
+			entry->flush_xid = xid;
+			memcpy(&result[n++], entry, sizeof(SrPlanStatsEntry));
+			entry->hits = 0;
+			entry->last_hit = 0;
+			continue;
+		}
+
+		memcpy(&result[n++], entry, sizeof(SrPlanStatsEntry));
+		if (entry->bad_samples > 0)
+		{
+			entry->hits = 0;
+			entry->last_hit = 0;
+		}
+		else
+			hash_search(sr_plan_stats, &entry->key, HASH_REMOVE, NULL);
+	}
+
+	LWLockRelease(sr_plan_state->lock);
+
+	*nentries = n;
+	return result;
+}
@@ -0,0 +1,554 @@
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "sr_plan.h"
+#include "miscadmin.h"
+#include "access/xlog.h"
+#include "storage/fd.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+#include "utils/tuplestore.h"
+
+PG_FUNCTION_INFO_V1(sr_plan_spool);
+PG_FUNCTION_INFO_V1(sr_plan_spool_reset);
+PG_FUNCTION_INFO_V1(sr_plan_import_spool);
+
+/* Plans captured during recovery are appended to this file in data directory */
+#define SR_PLAN_SPOOL_FILE		"sr_plan.spool"
+#define SR_PLAN_SPOOL_MAGIC		0x53525031
+
+#define Natts_sr_plan_spool		9
+
+/*
+ * Record of spool file, followed by query text, plan, deps, template,
+ * settings and profile name. Template and settings may be missing.
+ */
+typedef struct SrPlanSpoolRecord
+{
+	uint32		magic;
+	uint32		len;			/* length of record including this header */
+	Oid			database_id;
+	int32		profile_hash;
+	int32		query_hash;
+	int32		plan_hash;
+	int32		shape_hash;
+	int32		query_len;
+	int32		plan_len;
+	int32		deps_len;
+	int32		template_len;	/* 0 if there's no template */
+	int32		settings_len;	/* 0 if there're no settings */
+	int32		profile_len;
+} SrPlanSpoolRecord;
+
+/*
+ * Plans of the current database in spool file, read from the file up
+ * to spooled_offset. Each plan is entered under its shape and under
+ * zero shape, the latter is looked up when plans are captured once.
+ * Forgotten when the file is reset.
+ */
+static HTAB *spooled = NULL;
+static uint32 spooled_generation = 0;
+static long spooled_offset = 0;
+static bool spool_full_reported = false;
+
+static void
+sr_plan_spool_append(StringInfo buf, const void *data, int32 len)
+{
+	if (len > 0)
+		appendBinaryStringInfo(buf, (const char *) data, len);
+}
+
+/*
+ * Forget spooled plans if spool file was reset, maybe by another backend.
+ */
+static void
+sr_plan_spooled_init(void)
+{
+	uint32		generation = sr_plan_spool_generation();
+
+	if (spooled != NULL && spooled_generation != generation)
+	{
+		hash_destroy(spooled);
+		spooled = NULL;
+		spool_full_reported = false;
+	}
+
+	if (spooled == NULL)
+	{
+		HASHCTL		ctl;
+
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(SrPlanStatsKey);
+		ctl.entrysize = sizeof(SrPlanStatsKey);
+		ctl.hcxt = TopMemoryContext;
+		spooled = hash_create("sr_plan spooled plans", 64, &ctl,
+							  HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+		spooled_generation = generation;
+		spooled_offset = 0;
+	}
+}
+
+static void
+sr_plan_spooled_add(int32 profile_hash, int32 query_hash, int32 shape_hash)
+{
+	SrPlanStatsKey	key;
+
+	memset(&key, 0, sizeof(key));
+	key.database_id = MyDatabaseId;
+	key.profile_hash = profile_hash;
+	key.query_hash = query_hash;
+	key.plan_hash = shape_hash;
+	hash_search(spooled, &key, HASH_ENTER, NULL);
+
+	key.plan_hash = 0;
+	hash_search(spooled, &key, HASH_ENTER, NULL);
+}
+
+/*
+ * Read headers of records appended to spool file since the last call,
+ * e.g. by other backends, into spooled. Called under spool lock.
+ * Returns size of the file.
+ */
+static long
+sr_plan_spooled_update(void)
+{
+	SrPlanSpoolRecord	cur;
+	FILE			   *file;
+	long				size;
+
+	file = AllocateFile(SR_PLAN_SPOOL_FILE, PG_BINARY_R);
+	if (file == NULL)
+		return 0;
+
+	if (fseek(file, 0, SEEK_END) != 0 || (size = ftell(file)) < 0)
+	{
+		FreeFile(file);
+		return 0;
+	}
+
+	/* File was replaced behind our back, read it again */
+	if (size < spooled_offset)
+	{
+		hash_destroy(spooled);
+		spooled = NULL;
+		sr_plan_spooled_init();
+	}
+
+	if (fseek(file, spooled_offset, SEEK_SET) == 0)
+	{
+		while (fread(&cur, 1, sizeof(cur), file) == sizeof(cur))
+		{
+			/* Incomplete records are read again next time */
+			if (cur.magic != SR_PLAN_SPOOL_MAGIC || cur.len < sizeof(cur) ||
+				(int64) spooled_offset + cur.len > size)
+				break;
+
+			if (cur.database_id == MyDatabaseId)
+				sr_plan_spooled_add(cur.profile_hash, cur.query_hash,
+									cur.shape_hash);
+			spooled_offset += cur.len;
+
+			if (fseek(file, spooled_offset, SEEK_SET) != 0)
+				break;
+		}
+	}
+	FreeFile(file);
+
+	return size;
+}
+
+/*
+ * Append record to spool file with a single write() on O_APPEND
+ * descriptor, so that records of concurrent backends never interleave
+ * even if they aren't serialized by spool lock.
+ */
+static bool
+sr_plan_spool_write(StringInfo buf)
+{
+	int			fd;
+	bool		written;
+
+	fd = OpenTransientFile(SR_PLAN_SPOOL_FILE,
+						   O_WRONLY | O_CREAT | O_APPEND | PG_BINARY,
+						   S_IRUSR | S_IWUSR);
+	if (fd < 0)
+		return false;
+
+	written = (write(fd, buf->data, buf->len) == buf->len);
+	if (CloseTransientFile(fd) != 0)
+		written = false;
+
+	return written;
+}
+
+/*
+ * Save plan captured in write mode on hot standby into spool file,
+ * it can't be inserted into "sr_plans" until it's imported on primary.
+ * Failures are reported as warnings, the query is executed anyway.
+ */
+void
+sr_plan_spool_plan(int32 query_hash, int32 plan_hash, int32 shape_hash,
+				   const char *query, Jsonb *plan, PlannedStmt *pl_stmt)
+{
+	SrPlanStatsKey		key;
+	SrPlanSpoolRecord	rec;
+	StringInfoData		buf;
+	ArrayType		   *deps;
+	Jsonb			   *template = NULL;
+	Jsonb			   *settings;
+	LWLock			   *lock;
+	long				size;
+	bool				found;
+	bool				full = false;
+	bool				written = false;
+
+	sr_plan_spooled_init();
+
+	/* Plans of the same shape are duplicates, like in sr_plans */
+	memset(&key, 0, sizeof(key));
+	key.database_id = MyDatabaseId;
+	key.profile_hash = sr_plan_profile_hash(sr_plan_profile);
+	key.query_hash = query_hash;
+	key.plan_hash = sr_plan_capture_once ? 0 : shape_hash;
+	hash_search(spooled, &key, HASH_FIND, &found);
+	if (found)
+		return;
+
+	if (sr_plan_template_mode)
+	{
+		template = sr_plan_make_template(pl_stmt, sr_plan_fake_func);
+		if (template == NULL)
+		{
+			elog(LOG, "Plan depends on functions, it can't be saved as template.");
+			return;
+		}
+	}
+	deps = sr_plan_make_deps(pl_stmt->relationOids);
+	settings = sr_plan_current_settings();
+
+	memset(&rec, 0, sizeof(rec));
+	rec.magic = SR_PLAN_SPOOL_MAGIC;
+	rec.database_id = MyDatabaseId;
+	rec.profile_hash = key.profile_hash;
+	rec.query_hash = query_hash;
+	rec.plan_hash = plan_hash;
+	rec.shape_hash = shape_hash;
+	rec.query_len = strlen(query);
+	rec.plan_len = VARSIZE(plan);
+	rec.deps_len = VARSIZE(deps);
+	rec.template_len = template ? VARSIZE(template) : 0;
+	rec.settings_len = settings ? VARSIZE(settings) : 0;
+	rec.profile_len = strlen(sr_plan_profile);
+	rec.len = sizeof(rec) + rec.query_len + rec.plan_len + rec.deps_len +
+		rec.template_len + rec.settings_len + rec.profile_len;
+
+	/* Record is written at once, see sr_plan_spool_write() */
+	initStringInfo(&buf);
+	sr_plan_spool_append(&buf, &rec, sizeof(rec));
+	sr_plan_spool_append(&buf, query, rec.query_len);
+	sr_plan_spool_append(&buf, plan, rec.plan_len);
+	sr_plan_spool_append(&buf, deps, rec.deps_len);
+	sr_plan_spool_append(&buf, template, rec.template_len);
+	sr_plan_spool_append(&buf, settings, rec.settings_len);
+	sr_plan_spool_append(&buf, sr_plan_profile, rec.profile_len);
+
+	/*
+	 * Without shared memory plans are still appended safely, but the
+	 * same plan may be spooled by several backends.
+	 */
+	lock = sr_plan_spool_lock();
+	if (lock)
+		LWLockAcquire(lock, LW_EXCLUSIVE);
+
+	sr_plan_spooled_init();
+	size = sr_plan_spooled_update();
+	hash_search(spooled, &key, HASH_FIND, &found);
+	if (!found)
+		full = ((int64) size + buf.len > (int64) sr_plan_max_spool_size * 1024);
+
+	if (!found && !full)
+		written = sr_plan_spool_write(&buf);
+
+	if (lock)
+		LWLockRelease(lock);
+	pfree(buf.data);
+
+	if (full)
+	{
+		if (!spool_full_reported)
+			ereport(WARNING,
+					(errmsg("sr_plan spool file \"%s\" is full, plans aren't spooled",
+							SR_PLAN_SPOOL_FILE),
+					 errhint("Import the file on primary and reset it, or increase sr_plan.max_spool_size.")));
+		spool_full_reported = true;
+		return;
+	}
+
+	if (!found && !written)
+	{
+		ereport(WARNING,
+				(errcode_for_file_access(),
+				 errmsg("could not write plan to sr_plan spool file \"%s\": %m",
+						SR_PLAN_SPOOL_FILE)));
+		return;
+	}
+
+	/* The record itself is read by the next update */
+	if (!found)
+		sr_plan_spooled_add(rec.profile_hash, query_hash, shape_hash);
+}
+
+/*
+ * Check that fields of record fill it exactly.
+ */
+static bool
+sr_plan_spool_record_valid(const SrPlanSpoolRecord *rec)
+{
+	if (rec->magic != SR_PLAN_SPOOL_MAGIC || rec->len < sizeof(SrPlanSpoolRecord) ||
+		rec->len - sizeof(SrPlanSpoolRecord) > MaxAllocSize)
+		return false;
+
+	if (rec->query_len < 0 || rec->plan_len < VARHDRSZ ||
+		rec->deps_len < VARHDRSZ || rec->template_len < 0 ||
+		rec->settings_len < 0 || rec->profile_len < 0)
+		return false;
+
+	return ((Size) rec->query_len + (Size) rec->plan_len + (Size) rec->deps_len +
+			(Size) rec->template_len + (Size) rec->settings_len +
+			(Size) rec->profile_len == rec->len - sizeof(SrPlanSpoolRecord));
+}
+
+static void *
+sr_plan_spool_field(char **ptr, int32 len, const char *path)
+{
+	void	   *result;
+
+	if (len == 0)
+		return NULL;
+
+	/* Copy the field to get it aligned */
+	result = palloc(len);
+	memcpy(result, *ptr, len);
+	*ptr += len;
+
+	if (len < VARHDRSZ || VARSIZE(result) != len)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("invalid record in sr_plan spool file \"%s\"", path)));
+
+	return result;
+}
+
+/*
+ * Read plans of the current database from spool file.
+ * Incomplete record at the end of file is skipped.
+ */
+static List *
+sr_plan_read_spool(const char *path)
+{
+	List			   *result = NIL;
+	SrPlanSpoolRecord	rec;
+	FILE			   *file;
+
+	file = AllocateFile(path, PG_BINARY_R);
+	if (file == NULL)
+	{
+		if (errno == ENOENT)
+			return NIL;
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open sr_plan spool file \"%s\": %m", path)));
+	}
+
+	while (fread(&rec, 1, sizeof(rec), file) == sizeof(rec))
+	{
+		SrPlanCaptured *plan;
+		char		   *data;
+		char		   *ptr;
+		Size			len;
+
+		if (!sr_plan_spool_record_valid(&rec))
+			ereport(ERROR,
+					(errcode(ERRCODE_DATA_CORRUPTED),
+					 errmsg("invalid record in sr_plan spool file \"%s\"", path)));
+
+		len = rec.len - sizeof(rec);
+		data = palloc(len);
+		if (fread(data, 1, len, file) != len)
+		{
+			ereport(WARNING,
+					(errmsg("incomplete record at the end of sr_plan spool file \"%s\"",
+							path)));
+			pfree(data);
+			break;
+		}
+
+		if (rec.database_id != MyDatabaseId)
+		{
+			pfree(data);
+			continue;
+		}
+
+		ptr = data;
+		plan = (SrPlanCaptured *) palloc(sizeof(SrPlanCaptured));
+		plan->query_hash = rec.query_hash;
+		plan->plan_hash = rec.plan_hash;
+		plan->shape_hash = rec.shape_hash;
+		plan->query = cstring_to_text_with_len(ptr, rec.query_len);
+		ptr += rec.query_len;
+		plan->plan = (Jsonb *) sr_plan_spool_field(&ptr, rec.plan_len, path);
+		plan->deps = (ArrayType *) sr_plan_spool_field(&ptr, rec.deps_len, path);
+		plan->template = (Jsonb *) sr_plan_spool_field(&ptr, rec.template_len, path);
+		plan->settings = (Jsonb *) sr_plan_spool_field(&ptr, rec.settings_len, path);
+		plan->profile = pnstrdup(ptr, rec.profile_len);
+		pfree(data);
+
+		result = lappend(result, plan);
+	}
+
+	FreeFile(file);
+
+	return result;
+}
+
+static void
+sr_plan_check_spool_privileges(void)
+{
+	if (!superuser())
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("must be superuser to use sr_plan spool")));
+}
+
+/*
+ * Show plans of the current database waiting in spool file.
+ */
+Datum
+sr_plan_spool(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc			tupdesc;
+	Tuplestorestate	   *tupstore;
+	MemoryContext		oldcxt;
+	LWLock			   *lock;
+	List			   *plans;
+	ListCell		   *lc;
+
+	sr_plan_check_spool_privileges();
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo) ||
+		(rsinfo->allowedModes & SFRM_Materialize) == 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	oldcxt = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	tupdesc = CreateTupleDescCopy(tupdesc);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+	MemoryContextSwitchTo(oldcxt);
+
+	lock = sr_plan_spool_lock();
+	if (lock)
+		LWLockAcquire(lock, LW_SHARED);
+	plans = sr_plan_read_spool(SR_PLAN_SPOOL_FILE);
+	if (lock)
+		LWLockRelease(lock);
+
+	foreach(lc, plans)
+	{
+		SrPlanCaptured *plan = (SrPlanCaptured *) lfirst(lc);
+		Datum			values[Natts_sr_plan_spool];
+		bool			nulls[Natts_sr_plan_spool];
+
+		memset(nulls, false, sizeof(nulls));
+		values[0] = Int32GetDatum(plan->query_hash);
+		values[1] = Int32GetDatum(plan->plan_hash);
+		values[2] = Int32GetDatum(plan->shape_hash);
+		values[3] = PointerGetDatum(plan->query);
+		values[4] = PointerGetDatum(plan->plan);
+		values[5] = PointerGetDatum(plan->deps);
+		values[6] = PointerGetDatum(plan->template);
+		nulls[6] = (plan->template == NULL);
+		values[7] = PointerGetDatum(plan->settings);
+		nulls[7] = (plan->settings == NULL);
+		values[8] = CStringGetTextDatum(plan->profile);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+/*
+ * Remove spool file, e.g. after it was imported on primary.
+ */
+Datum
+sr_plan_spool_reset(PG_FUNCTION_ARGS)
+{
+	LWLock	   *lock;
+
+	sr_plan_check_spool_privileges();
+
+	lock = sr_plan_spool_lock();
+	if (lock)
+		LWLockAcquire(lock, LW_EXCLUSIVE);
+
+	if (unlink(SR_PLAN_SPOOL_FILE) != 0 && errno != ENOENT)
+	{
+		if (lock)
+			LWLockRelease(lock);
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not remove sr_plan spool file \"%s\": %m",
+						SR_PLAN_SPOOL_FILE)));
+	}
+
+	/* Other backends forget their spooled plans too */
+	sr_plan_spool_next_generation();
+
+	if (lock)
+		LWLockRelease(lock);
+
+	if (spooled != NULL)
+	{
+		hash_destroy(spooled);
+		spooled = NULL;
+	}
+	spool_full_reported = false;
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * Store plans of the current database from spool file copied
+ * from standby into "sr_plans", plans which are there already are skipped.
+ */
+Datum
+sr_plan_import_spool(PG_FUNCTION_ARGS)
+{
+	char	   *path = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	Oid			schema_oid;
+
+	sr_plan_check_spool_privileges();
+
+	if (RecoveryInProgress())
+		ereport(ERROR,
+				(errcode(ERRCODE_READ_ONLY_SQL_TRANSACTION),
+				 errmsg("cannot import sr_plan spool during recovery"),
+				 errhint("Copy spool file to primary and import it there.")));
+
+	schema_oid = get_sr_plan_schema();
+	if (!OidIsValid(schema_oid))
+		elog(ERROR, "Cannot find sr_plan schema");
+
+	PG_RETURN_INT32(sr_plan_store_plans(schema_oid, sr_plan_read_spool(path)));
+}
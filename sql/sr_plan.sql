@@ -72,5 +72,409 @@ SET enable_bitmapscan = t;
 SET enable_indexonlyscan = t;
 
 
+/* stored plan is kept after GRANT, but not used after table rewrite */
+SET enable_indexscan = f;
+SET enable_bitmapscan = f;
+SET enable_indexonlyscan = f;
+
+EXPLAIN (COSTS OFF) SELECT * FROM test_table WHERE test_attr1 = 15;
+GRANT SELECT ON test_table TO PUBLIC;
+EXPLAIN (COSTS OFF) SELECT * FROM test_table WHERE test_attr1 = 15;
+VACUUM FULL test_table;
+EXPLAIN (COSTS OFF) SELECT * FROM test_table WHERE test_attr1 = 15;
+
+SET enable_indexscan = t;
+SET enable_bitmapscan = t;
+SET enable_indexonlyscan = t;
+
+
+/* capture only the first plan of a query */
+SET sr_plan.write_mode = true;
+SET sr_plan.capture_once = true;
+
+SELECT count(*) FROM test_table WHERE test_attr1 < 50;
+SET enable_seqscan = f;
+SELECT count(*) FROM test_table WHERE test_attr1 < 50;
+
+SET enable_seqscan = t;
+SET sr_plan.capture_once = false;
+SET sr_plan.write_mode = false;
+
+SELECT count(*) FROM sr_plans WHERE query LIKE '%test_attr1 < 50%';
+
+
+/* shapes of saved plans */
+SELECT count(*) FROM sr_plans WHERE shape_hash IS NULL;
+SELECT count(DISTINCT query_hash) FROM sr_plans_history;
+
+
+/* plans which differ only in estimates have the same shape */
+CREATE TABLE shape_a(id int);
+CREATE INDEX shape_a_id_idx ON shape_a (id);
+
+SET enable_seqscan = f;
+SET enable_bitmapscan = f;
+SET enable_indexonlyscan = f;
+SET sr_plan.write_mode = true;
+SET sr_plan.profile = 'small';
+SELECT * FROM shape_a WHERE id = _p(1);
+SET sr_plan.write_mode = false;
+
+INSERT INTO shape_a SELECT generate_series(1, 1000);
+ANALYZE shape_a;
+
+SET sr_plan.write_mode = true;
+SET sr_plan.profile = 'large';
+SELECT * FROM shape_a WHERE id = _p(1);
+SET sr_plan.write_mode = false;
+RESET sr_plan.profile;
+SET enable_seqscan = t;
+SET enable_bitmapscan = t;
+SET enable_indexonlyscan = t;
+
+SELECT count(DISTINCT plan_hash) AS plans, count(DISTINCT shape_hash) AS shapes
+FROM sr_plans WHERE query LIKE '%shape_a%';
+DELETE FROM sr_plans WHERE query LIKE '%shape_a%';
+DROP TABLE shape_a;
+
+
+/* plans with another join order have another shape, it can be pinned */
+CREATE TABLE join_a(id int);
+CREATE TABLE join_b(id int);
+CREATE TABLE join_c(id int, x int);
+INSERT INTO join_a SELECT generate_series(1, 1000);
+INSERT INTO join_b SELECT generate_series(1, 1000);
+INSERT INTO join_c SELECT i, i FROM generate_series(1, 10) AS i;
+ANALYZE join_a;
+ANALYZE join_b;
+ANALYZE join_c;
+
+SET sr_plan.track_shapes = true;
+SELECT count(*) FROM join_a JOIN join_b ON join_a.id = join_b.id JOIN join_c ON join_c.id = join_b.id WHERE join_c.x = 1;
+SET join_collapse_limit = 1;
+SELECT count(*) FROM join_a JOIN join_b ON join_a.id = join_b.id JOIN join_c ON join_c.id = join_b.id WHERE join_c.x = 1;
+RESET join_collapse_limit;
+SET sr_plan.track_shapes = false;
+
+SELECT count(*) FROM sr_plans_history WHERE query LIKE 'SELECT count(*) FROM join_a%';
+SELECT sr_plan_pin_shape(query_hash, shape_hash) FROM sr_plans_history
+WHERE query LIKE 'SELECT count(*) FROM join_a%' ORDER BY first_seen DESC LIMIT 1;
+SELECT enable, valid FROM sr_plans WHERE query LIKE 'SELECT count(*) FROM join_a%';
+SELECT count(*) FROM join_a JOIN join_b ON join_a.id = join_b.id JOIN join_c ON join_c.id = join_b.id WHERE join_c.x = 1;
+
+DELETE FROM sr_plans WHERE query LIKE 'SELECT count(*) FROM join_a%';
+DROP TABLE join_a;
+DROP TABLE join_b;
+DROP TABLE join_c;
+
+
+/* plan template captured in one schema is used in another */
+CREATE SCHEMA tenant1;
+CREATE SCHEMA tenant2;
+CREATE TABLE tenant1.accounts(id int);
+CREATE TABLE tenant2.accounts(id int);
+CREATE INDEX accounts_id_idx ON tenant1.accounts (id);
+CREATE INDEX accounts_id_idx ON tenant2.accounts (id);
+
+SET sr_plan.template_mode = true;
+SET search_path = tenant1, public;
+SET sr_plan.write_mode = true;
+SET enable_seqscan = f;
+SET enable_bitmapscan = f;
+SET enable_indexonlyscan = f;
+
+SELECT * FROM accounts WHERE id = _p(1);
+
+SET enable_seqscan = t;
+SET enable_bitmapscan = t;
+SET enable_indexonlyscan = t;
+SET sr_plan.write_mode = false;
+
+UPDATE sr_plans SET enable = true WHERE template IS NOT NULL;
+
+SET search_path = tenant2, public;
+EXPLAIN (COSTS OFF) SELECT * FROM accounts WHERE id = _p(1);
+
+SET search_path = tenant1, public;
+SET enable_indexscan = f;
+SET enable_bitmapscan = f;
+EXPLAIN (COSTS OFF) SELECT * FROM tenant2.accounts WHERE id = _p(1);
+SET enable_indexscan = t;
+SET enable_bitmapscan = t;
+
+RESET search_path;
+SET sr_plan.template_mode = false;
+DELETE FROM sr_plans WHERE query LIKE '%accounts%';
+DROP SCHEMA tenant1 CASCADE;
+DROP SCHEMA tenant2 CASCADE;
+
+
+/* templates of queries on relations with other names differ */
+CREATE SCHEMA tenant3;
+CREATE TABLE tenant3.events_2023(id int);
+CREATE TABLE tenant3.events_2024(id int);
+CREATE INDEX events_2023_id_idx ON tenant3.events_2023 (id);
+
+SET sr_plan.template_mode = true;
+SET search_path = tenant3, public;
+SET sr_plan.write_mode = true;
+SET enable_seqscan = f;
+SET enable_bitmapscan = f;
+SET enable_indexonlyscan = f;
+
+SELECT * FROM events_2023 e WHERE e.id = _p(1);
+
+SET enable_seqscan = t;
+SET enable_bitmapscan = t;
+SET enable_indexonlyscan = t;
+SET sr_plan.write_mode = false;
+
+UPDATE sr_plans SET enable = true WHERE template IS NOT NULL;
+
+EXPLAIN (COSTS OFF) SELECT * FROM events_2024 e WHERE e.id = _p(1);
+
+RESET search_path;
+SET sr_plan.template_mode = false;
+DELETE FROM sr_plans WHERE query LIKE '%events_2023%';
+DROP SCHEMA tenant3 CASCADE;
+
+
+/* children of saved plan follow the current partitions */
+CREATE TABLE measurements(id int);
+CREATE TABLE measurements_1(CHECK (id < 100)) INHERITS (measurements);
+CREATE TABLE measurements_2(CHECK (id >= 100 AND id < 200)) INHERITS (measurements);
+CREATE INDEX ON measurements_1 (id);
+CREATE INDEX ON measurements_2 (id);
+
+SET sr_plan.write_mode = true;
+SET enable_seqscan = f;
+SET enable_bitmapscan = f;
+SET enable_indexonlyscan = f;
+
+SELECT * FROM measurements WHERE id = _p(150);
+
+SET enable_seqscan = t;
+SET enable_bitmapscan = t;
+SET enable_indexonlyscan = t;
+SET sr_plan.write_mode = false;
+
+UPDATE sr_plans SET enable = true WHERE query LIKE '%measurements%';
+
+CREATE TABLE measurements_3(CHECK (id >= 200 AND id < 300)) INHERITS (measurements);
+CREATE INDEX ON measurements_3 (id);
+EXPLAIN (COSTS OFF) SELECT * FROM measurements WHERE id = _p(250);
+
+DELETE FROM sr_plans WHERE query LIKE '%measurements%';
+DROP TABLE measurements CASCADE;
+
+
+/* saved plan is made again with its planner settings */
+SELECT settings FROM sr_plans WHERE query = 'SELECT * FROM test_table WHERE test_attr2 = _p(15);';
+SET sr_plan.replay_settings = true;
+EXPLAIN (COSTS OFF) SELECT * FROM test_table WHERE test_attr2 = _p(20);
+
+/* plan made with other settings is used only if it has the same shape */
+UPDATE sr_plans SET settings = '{"enable_indexscan": "off", "enable_bitmapscan": "off"}'
+WHERE query = 'SELECT * FROM test_table WHERE test_attr2 = _p(15);';
+EXPLAIN (COSTS OFF) SELECT * FROM test_table WHERE test_attr2 = _p(20);
+SET sr_plan.replay_verify = false;
+EXPLAIN (COSTS OFF) SELECT * FROM test_table WHERE test_attr2 = _p(20);
+SET sr_plan.replay_verify = true;
+
+/* only planner settings are replayed */
+UPDATE sr_plans SET settings = '{"log_min_duration_statement": 0}'
+WHERE query = 'SELECT * FROM test_table WHERE test_attr2 = _p(15);';
+EXPLAIN (COSTS OFF) SELECT * FROM test_table WHERE test_attr2 = _p(20);
+
+UPDATE sr_plans SET settings = '{"enable_seqscan": "off", "enable_bitmapscan": "off", "enable_indexonlyscan": "off"}'
+WHERE query = 'SELECT * FROM test_table WHERE test_attr2 = _p(15);';
+SET sr_plan.replay_settings = false;
+
+
+/* plans of named profiles */
+CREATE TABLE orders(id int);
+CREATE INDEX orders_id_idx ON orders (id);
+
+SET sr_plan.write_mode = true;
+SET enable_seqscan = f;
+SET enable_bitmapscan = f;
+SELECT * FROM orders WHERE id = _p(1);
+SET enable_seqscan = t;
+
+SET sr_plan.profile = 'batch';
+SET enable_indexscan = f;
+SELECT * FROM orders WHERE id = _p(1);
+SET enable_indexscan = t;
+SET enable_bitmapscan = t;
+SET sr_plan.write_mode = false;
+
+UPDATE sr_plans SET enable = true WHERE query LIKE '%orders%';
+SELECT profile FROM sr_plans WHERE query LIKE '%orders%' ORDER BY profile;
+
+EXPLAIN (COSTS OFF) SELECT * FROM orders WHERE id = _p(1);
+SET sr_plan.profile = 'reports';
+EXPLAIN (COSTS OFF) SELECT * FROM orders WHERE id = _p(1);
+RESET sr_plan.profile;
+EXPLAIN (COSTS OFF) SELECT * FROM orders WHERE id = _p(1);
+
+DELETE FROM sr_plans WHERE query LIKE '%orders%';
+DROP TABLE orders;
+
+
+/* hits of saved plans and eviction of disabled plans */
+SELECT sr_plan_evict();
+SELECT hits FROM sr_plans WHERE query LIKE '%test_attr1 < 50%';
+DELETE FROM sr_plans WHERE query LIKE '%test_attr1 < 50%';
+
+CREATE TABLE evict_test(id int);
+
+SET sr_plan.write_mode = true;
+SELECT * FROM evict_test WHERE id = 1;
+SELECT * FROM evict_test WHERE id = 2;
+SELECT * FROM evict_test WHERE id = 3;
+SELECT * FROM evict_test WHERE id = 1;
+SET sr_plan.write_mode = false;
+
+UPDATE sr_plans SET enable = true WHERE query LIKE '%evict_test%';
+SELECT * FROM evict_test WHERE id = 2;
+SELECT * FROM evict_test WHERE id = 2;
+SELECT * FROM evict_test WHERE id = 3;
+UPDATE sr_plans SET enable = false WHERE query LIKE '%evict_test%';
+
+SELECT sr_plan_evict();
+SELECT query, hits FROM sr_plans WHERE query LIKE '%evict_test%' ORDER BY query;
+
+SET sr_plan.eviction_policy = 'hits';
+DO $$ BEGIN EXECUTE format('SET sr_plan.max_plans = %s', (SELECT count(*) - 1 FROM sr_plans)); END $$;
+SELECT sr_plan_evict();
+SELECT query FROM sr_plans WHERE query LIKE '%evict_test%' ORDER BY query;
+
+SET sr_plan.eviction_policy = 'last_hit';
+DO $$ BEGIN EXECUTE format('SET sr_plan.max_plans = %s', (SELECT count(*) - 1 FROM sr_plans)); END $$;
+SELECT sr_plan_evict();
+SELECT query FROM sr_plans WHERE query LIKE '%evict_test%' ORDER BY query;
+
+RESET sr_plan.max_plans;
+RESET sr_plan.eviction_policy;
+DELETE FROM sr_plans WHERE query LIKE '%evict_test%';
+DROP TABLE evict_test;
+
+
+/* plans captured in batch from a table, one plan per shape */
+CREATE TABLE workload(query text);
+INSERT INTO workload VALUES
+	('SELECT * FROM test_table WHERE test_attr1 = _p(30)'),
+	('SELECT * FROM test_table WHERE test_attr1 = _p(40)'),
+	('SELECT count(*) FROM test_table');
+
+SELECT sr_plan_capture_batch('workload'::regclass, '{"enable_seqscan": "off"}', 1);
+SELECT sr_plan_capture_batch('workload'::regclass, '{"enable_seqscan": "off"}', 1);
+SELECT query, enable, settings FROM sr_plans
+WHERE query IN (SELECT query FROM workload) ORDER BY length(query);
+
+CREATE ROLE regress_sr_plan_user;
+SET ROLE regress_sr_plan_user;
+SELECT sr_plan_capture_batch(ARRAY['SELECT 1']);
+RESET ROLE;
+DROP ROLE regress_sr_plan_user;
+
+DELETE FROM sr_plans WHERE query IN (SELECT query FROM workload);
+DROP TABLE workload;
+
+
+/* plans of queries which are expensive to plan are cached */
+CREATE TABLE cache_test(id int);
+
+SET sr_plan.auto_cache_threshold = '1h';
+SELECT * FROM cache_test WHERE id = 1;
+RESET sr_plan.auto_cache_threshold;
+SELECT count(*) FROM sr_plans WHERE query LIKE 'SELECT * FROM cache_test%';
+
+SET sr_plan.auto_cache_threshold = 0;
+BEGIN READ ONLY;
+SELECT * FROM cache_test WHERE id = 1;
+COMMIT;
+RESET sr_plan.auto_cache_threshold;
+SELECT count(*) FROM sr_plans WHERE query LIKE 'SELECT * FROM cache_test%';
+
+SET sr_plan.auto_cache_threshold = 0;
+SELECT * FROM cache_test WHERE id = 1;
+RESET sr_plan.auto_cache_threshold;
+SELECT enable, expires > now() AS not_expired FROM sr_plans
+WHERE query LIKE 'SELECT * FROM cache_test%';
+
+UPDATE sr_plans SET expires = now() - interval '1 min'
+WHERE query LIKE 'SELECT * FROM cache_test%';
+SELECT sr_plan_evict();
+SELECT count(*) FROM sr_plans WHERE query LIKE 'SELECT * FROM cache_test%';
+DROP TABLE cache_test;
+
+
+/* plan with wrong estimates is disabled by executor feedback */
+CREATE TABLE feedback_test(id int);
+INSERT INTO feedback_test SELECT generate_series(1, 1000);
+CREATE INDEX feedback_test_id_idx ON feedback_test (id);
+ANALYZE feedback_test;
+
+SET sr_plan.write_mode = true;
+SET enable_seqscan = f;
+SET enable_bitmapscan = f;
+SET enable_indexonlyscan = f;
+SELECT count(*) FROM feedback_test WHERE id = _p(1);
+SET enable_seqscan = t;
+SET enable_bitmapscan = t;
+SET enable_indexonlyscan = t;
+SET sr_plan.write_mode = false;
+
+UPDATE sr_plans SET enable = true WHERE query LIKE '%feedback_test%';
+UPDATE feedback_test SET id = 1;
+
+SET sr_plan.feedback_sample_rate = 1;
+SET sr_plan.feedback_min_samples = 1;
+SELECT count(*) FROM feedback_test WHERE id = _p(1);
+RESET sr_plan.feedback_min_samples;
+RESET sr_plan.feedback_sample_rate;
+
+SELECT sr_plan_evict();
+SELECT enable, reason FROM sr_plans WHERE query LIKE '%feedback_test%';
+
+DELETE FROM sr_plans WHERE query LIKE '%feedback_test%';
+DROP TABLE feedback_test;
+
+
+/* spool file is checked when it's read */
+SELECT sr_plan_import_spool('sr_plan.spool');
+DO $$
+BEGIN
+	EXECUTE format('COPY (SELECT 1 WHERE false) TO %L',
+				   current_setting('data_directory') || '/sr_plan.spool');
+END
+$$;
+SELECT count(*) FROM sr_plan_spool();
+SELECT sr_plan_import_spool('sr_plan.spool');
+
+DO $$
+BEGIN
+	EXECUTE format('COPY (SELECT repeat(''x'', 100)) TO %L',
+				   current_setting('data_directory') || '/sr_plan.spool');
+END
+$$;
+SELECT count(*) FROM sr_plan_spool();
+SELECT sr_plan_import_spool('sr_plan.spool');
+
+SELECT sr_plan_spool_reset();
+SELECT sr_plan_import_spool('sr_plan.spool');
+
+CREATE ROLE regress_sr_plan_user;
+SET ROLE regress_sr_plan_user;
+SELECT count(*) FROM sr_plan_spool();
+SELECT sr_plan_spool_reset();
+RESET ROLE;
+DROP ROLE regress_sr_plan_user;
+
+
+SELECT count(*) FROM sr_plan_spool();
+
+
 DROP TABLE test_table;
 DROP EXTENSION sr_plan;
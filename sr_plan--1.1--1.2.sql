@@ -0,0 +1,148 @@
+/* hit counters are flushed by sr_plan_evict() or maintenance worker */
+ALTER TABLE sr_plans ADD COLUMN hits bigint NOT NULL DEFAULT 0;
+ALTER TABLE sr_plans ADD COLUMN last_hit timestamptz;
+
+/* flush hit counters and evict plans exceeding sr_plan.max_plans */
+CREATE FUNCTION sr_plan_evict()
+RETURNS int
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+/* plan queries in background workers and store plans without executing */
+CREATE FUNCTION sr_plan_capture_batch(queries text[],
+									  settings jsonb DEFAULT NULL,
+									  workers int DEFAULT 2)
+RETURNS int
+AS 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE;
+
+/* capture queries from "query" column of a table */
+CREATE FUNCTION sr_plan_capture_batch(source regclass,
+									  settings jsonb DEFAULT NULL,
+									  workers int DEFAULT 2)
+RETURNS int AS $$
+DECLARE
+	queries text[];
+BEGIN
+	EXECUTE format('SELECT array_agg(query::text) FROM %s', source)
+	INTO queries;
+
+	RETURN sr_plan_capture_batch(queries, settings, workers);
+END
+$$ LANGUAGE plpgsql VOLATILE;
+
+/* capture queries from a file, each one ends with a semicolon and newline */
+CREATE FUNCTION sr_plan_capture_batch_file(path text,
+										   settings jsonb DEFAULT NULL,
+										   workers int DEFAULT 2)
+RETURNS int AS $$
+DECLARE
+	queries text[];
+BEGIN
+	SELECT array_agg(q) INTO queries
+	FROM regexp_split_to_table(pg_read_file(path), E';[ \\t]*\\n') AS q
+	WHERE btrim(q, E' \\t\\n\\r') <> '';
+
+	RETURN sr_plan_capture_batch(queries, settings, workers);
+END
+$$ LANGUAGE plpgsql VOLATILE;
+
+/*
+ * capture queries of current database from pg_stat_statements,
+ * utility statements are skipped
+ */
+CREATE FUNCTION sr_plan_capture_batch_pgss(settings jsonb DEFAULT NULL,
+										   workers int DEFAULT 2)
+RETURNS int AS $$
+DECLARE
+	queries text[];
+BEGIN
+	SELECT array_agg(s.query) INTO queries
+	FROM pg_stat_statements s
+	WHERE s.dbid = (SELECT oid FROM pg_database
+					WHERE datname = current_database())
+	  AND s.query ~* '^\s*(select|insert|update|delete|with|values|table)\M';
+
+	RETURN sr_plan_capture_batch(queries, settings, workers);
+END
+$$ LANGUAGE plpgsql VOLATILE;
+
+/* (relid, relfilenode, row type and index set signatures) of relations plan depends on */
+ALTER TABLE sr_plans ADD COLUMN deps oid[];
+
+/* plans saved by plan cache expire, see sr_plan.auto_cache_ttl */
+ALTER TABLE sr_plans ADD COLUMN expires timestamptz;
+
+/* hash of plan without costs and estimates, see sr_plans_history */
+ALTER TABLE sr_plans ADD COLUMN shape_hash int;
+
+CREATE TABLE sr_plans_history (
+	query_hash	int NOT NULL,
+	shape_hash	int NOT NULL,
+	plan_hash	int NOT NULL,
+	first_seen	timestamptz NOT NULL,
+	last_seen	timestamptz NOT NULL,
+	query		text NOT NULL,
+	plan		jsonb NOT NULL,
+	deps		oid[]
+);
+CREATE UNIQUE INDEX sr_plans_history_query_hash_idx ON sr_plans_history (query_hash, shape_hash);
+
+/* enable plan of the shape for query, it's taken from history if not saved */
+CREATE FUNCTION sr_plan_pin_shape(query_hash int, shape_hash int)
+RETURNS bool AS $$
+DECLARE
+	cur_profile text := current_setting('sr_plan.profile');
+BEGIN
+	UPDATE sr_plans p SET enable = coalesce(p.shape_hash = $2, false)
+	WHERE p.query_hash = $1 AND p.profile = cur_profile;
+
+	PERFORM 1 FROM sr_plans p
+	WHERE p.query_hash = $1 AND p.shape_hash = $2
+		AND p.profile = cur_profile;
+	IF FOUND THEN
+		RETURN true;
+	END IF;
+
+	INSERT INTO sr_plans (query_hash, plan_hash, query, plan, enable, valid,
+						  deps, shape_hash, profile)
+	SELECT h.query_hash, h.plan_hash, h.query, h.plan, true, true,
+		   h.deps, h.shape_hash, cur_profile
+	FROM sr_plans_history h
+	WHERE h.query_hash = $1 AND h.shape_hash = $2;
+
+	RETURN FOUND;
+END
+$$ LANGUAGE plpgsql VOLATILE;
+
+/* why the plan was disabled by executor feedback */
+ALTER TABLE sr_plans ADD COLUMN reason text;
+
+/* names of relations of plan saved in sr_plan.template_mode */
+ALTER TABLE sr_plans ADD COLUMN template jsonb;
+
+/* non-default planner settings plan was captured with, see sr_plan.replay_settings */
+ALTER TABLE sr_plans ADD COLUMN settings jsonb;
+
+/* plans are used by sessions with the same sr_plan.profile */
+ALTER TABLE sr_plans ADD COLUMN profile text NOT NULL DEFAULT 'default';
+
+/* plans captured on hot standby, see sr_plan_import_spool() */
+CREATE FUNCTION sr_plan_spool(OUT query_hash int, OUT plan_hash int,
+							  OUT shape_hash int, OUT query text,
+							  OUT plan jsonb, OUT deps oid[],
+							  OUT template jsonb, OUT settings jsonb,
+							  OUT profile text)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION sr_plan_spool_reset()
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION sr_plan_import_spool(path text)
+RETURNS int
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
@@ -6,6 +6,9 @@
 #include "access/sysattr.h"
 #include "access/xact.h"
 #include "utils/lsyscache.h"
+#include "miscadmin.h"
+#include "access/xlog.h"
+#include <float.h>
 
 #if PG_VERSION_NUM >= 100000
 #include "utils/queryenvironment.h"
@@ -17,6 +20,31 @@ PG_MODULE_MAGIC;
 void	_PG_init(void);
 
 static bool sr_plan_write_mode = false;
+bool sr_plan_capture_once = false;
+int sr_plan_max_plans = 0;
+int sr_plan_eviction_policy = SR_PLAN_EVICT_LAST_HIT;
+int sr_plan_maintenance_naptime = 60;
+char *sr_plan_maintenance_database = NULL;
+int sr_plan_auto_cache_threshold = -1;
+int sr_plan_auto_cache_ttl = 3600;
+bool sr_plan_track_shapes = false;
+bool sr_plan_template_mode = false;
+bool sr_plan_replay_settings = false;
+bool sr_plan_replay_verify = true;
+char *sr_plan_profile = NULL;
+double sr_plan_feedback_sample_rate = 0;
+double sr_plan_feedback_threshold = 100;
+int sr_plan_feedback_min_samples = 3;
+int sr_plan_max_spool_size = 10240;
+
+/* Set while sr_plan runs its own queries, they are planned as usual */
+bool sr_plan_bypass = false;
+
+static const struct config_enum_entry eviction_policy_options[] = {
+	{"last_hit", SR_PLAN_EVICT_LAST_HIT, false},
+	{"hits", SR_PLAN_EVICT_HITS, false},
+	{NULL, 0, false}
+};
 
 PlannedStmt *sr_planner(Query *parse,
 						int cursorOptions,
@@ -27,14 +55,18 @@ PlanCacheRelCallback(Datum arg, Oid relid);*/
 void sr_analyze(ParseState *pstate,
 				Query *query);
 
-static Oid get_sr_plan_schema(void);
 static Oid sr_get_relname_oid(Oid schema_oid, const char *relname);
 bool sr_query_walker(Query *node, void *context);
 bool sr_query_expr_walker(Node *node, void *context);
 void *replace_fake(void *node);
+static void *sr_plan_load_hook(void *node);
 void walker_callback(void *node);
 
-static Oid sr_plan_fake_func = 0;
+/* field4 of advisory lock tags used by sr_plan, 1 and 2 are used by SQL functions */
+#define SR_PLAN_LOCK_AUTO_CACHE		3
+#define SR_PLAN_LOCK_HISTORY		4
+
+Oid sr_plan_fake_func = 0;
 static Oid dropped_objects_func = 0;
 
 struct QueryParams
@@ -44,6 +76,8 @@ struct QueryParams
 };
 
 List *query_params;
+/* Binding of template plan being loaded */
+static SrPlanBinding *load_binding = NULL;
 const char *query_text;
 
 static post_parse_analyze_hook_type post_parse_analyze_hook_next = NULL;
@@ -70,7 +104,7 @@ void sr_analyze(ParseState *pstate, Query *query)
 /*
  * Return sr_plan schema's Oid or InvalidOid if that's not possible.
  */
-static Oid
+Oid
 get_sr_plan_schema(void)
 {
 	Oid				result;
@@ -126,38 +160,481 @@ static Oid sr_get_relname_oid(Oid schema_oid, const char *relname)
 	return get_relname_relid(relname, schema_oid);
 }
 
+/*
+ * Compute hash of a query the same way for capture and lookup.
+ * Must be called before the query is planned.
+ */
+int32
+sr_plan_query_hash(Query *parse, Oid schema_oid)
+{
+	Jsonb *out_jsonb;
+
+	if(sr_plan_fake_func)
+	{
+		HeapTuple   ftup;
+		ftup = SearchSysCache1(PROCOID, ObjectIdGetDatum(sr_plan_fake_func));
+		if(!HeapTupleIsValid(ftup)) sr_plan_fake_func = 0;
+		else ReleaseSysCache(ftup);
+	}
+
+	if (!sr_plan_fake_func)
+	{
+		Oid args[1] = {ANYELEMENTOID};
+		char *schema_name;
+		List *func_name_list;
+
+		schema_name = get_namespace_name(schema_oid);
+		func_name_list = list_make2(makeString(schema_name), makeString("_p"));
+		sr_plan_fake_func = LookupFuncName(func_name_list, 1, args, true);
+		list_free(func_name_list);
+		pfree(schema_name);
+	}
+
+	if (sr_plan_template_mode)
+		return sr_plan_template_hash(parse, sr_plan_fake_func);
+
+	out_jsonb = node_tree_to_jsonb(parse, sr_plan_fake_func, true);
+	return DatumGetInt32(DirectFunctionCall1(jsonb_hash, PointerGetDatum(out_jsonb)));
+}
+
+/*
+ * Try to take a transaction lock on (key1, key2), false if another
+ * session holds it. Sessions which capture the same plan at the same time
+ * see no rows of each other, the lock lets only one of them insert the plan.
+ */
+static bool
+sr_plan_try_lock(int32 key1, int32 key2, uint16 kind)
+{
+	LOCKTAG		tag;
+
+	SET_LOCKTAG_ADVISORY(tag, MyDatabaseId, (uint32) key1, (uint32) key2, kind);
+
+	return LockAcquire(&tag, ExclusiveLock, false, true) != LOCKACQUIRE_NOT_AVAIL;
+}
+
+/*
+ * Check if profile of stored plan is profile, without a copy of the name.
+ */
+static bool
+sr_plan_profile_equal(Datum value, const char *profile)
+{
+	text	   *name = DatumGetTextPP(value);
+	int			len = VARSIZE_ANY_EXHDR(name);
+	bool		result;
+
+	result = (len == strlen(profile) &&
+			  memcmp(VARDATA_ANY(name), profile, len) == 0);
+	if ((Pointer) name != DatumGetPointer(value))
+		pfree(name);
+
+	return result;
+}
+
+/*
+ * Find plan of query_hash in profile with the same shape in sr_plans (or
+ * the same plan_hash for plans without shape_hash), any plan of query_hash
+ * in profile matches if any_plan is true. Return a copy of the tuple or NULL.
+ */
+HeapTuple
+sr_plans_find_plan(Relation sr_plans_heap, Relation query_index_rel,
+				   int32 query_hash, int32 plan_hash, int32 shape_hash,
+				   const char *profile, bool any_plan)
+{
+	IndexScanDesc query_index_scan;
+	ScanKeyData key;
+	HeapTuple found = NULL;
+
+	ScanKeyInit(&key,
+				1,
+				BTEqualStrategyNumber,
+				F_INT4EQ,
+				Int32GetDatum(query_hash));
+
+	query_index_scan = index_beginscan(sr_plans_heap,
+									   query_index_rel,
+									   SnapshotSelf,
+									   1,
+									   0);
+	index_rescan(query_index_scan,
+				 &key, 1,
+				 NULL, 0);
+	for (;;)
+	{
+		HeapTuple local_tuple;
+		Datum stored_shape_hash;
+		bool isnull;
+		ItemPointer tid = index_getnext_tid(query_index_scan, ForwardScanDirection);
+		if (tid == NULL)
+			break;
+
+		local_tuple = index_fetch_heap(query_index_scan);
+		if (local_tuple == NULL)
+			continue;
+
+		if (!sr_plan_profile_equal(heap_getattr(local_tuple, Anum_sr_plans_profile,
+												RelationGetDescr(sr_plans_heap),
+												&isnull),
+								   profile))
+			continue;
+
+		stored_shape_hash = heap_getattr(local_tuple, Anum_sr_plans_shape_hash,
+										 RelationGetDescr(sr_plans_heap),
+										 &isnull);
+
+		/* Detect plan duplicate */
+		if (any_plan ||
+			(!isnull && DatumGetInt32(stored_shape_hash) == shape_hash) ||
+			(isnull && DatumGetInt32(heap_getattr(local_tuple, Anum_sr_plans_plan_hash,
+												  RelationGetDescr(sr_plans_heap),
+												  &isnull)) == plan_hash))
+		{
+			found = heap_copytuple(local_tuple);
+			break;
+		}
+	}
+	index_endscan(query_index_scan);
+
+	return found;
+}
+
+/*
+ * Insert a new plan into sr_plans. Zero expires means the plan never expires.
+ */
+static void
+sr_plans_insert_plan(Relation sr_plans_heap, Relation query_index_rel,
+					 int32 query_hash, Datum plan_hash, int32 shape_hash,
+					 Jsonb *plan, PlannedStmt *pl_stmt, bool enable,
+					 TimestampTz expires)
+{
+	Datum		values[Natts_sr_plans];
+	bool		nulls[Natts_sr_plans];
+	HeapTuple	tuple;
+	Jsonb	   *template = NULL;
+#if PG_VERSION_NUM >= 100000
+	IndexInfo  *indexInfo;
+#endif
+
+	if (sr_plan_template_mode)
+	{
+		template = sr_plan_make_template(pl_stmt, sr_plan_fake_func);
+		if (template == NULL)
+		{
+			elog(LOG, "Plan depends on functions, it can't be saved as template.");
+			return;
+		}
+	}
+
+#if PG_VERSION_NUM >= 100000
+	indexInfo = BuildIndexInfo(query_index_rel);
+#endif
+	memset(nulls, false, sizeof(nulls));
+	values[Anum_sr_plans_query_hash - 1] = Int32GetDatum(query_hash);
+	values[Anum_sr_plans_plan_hash - 1] = plan_hash;
+	values[Anum_sr_plans_query - 1] = CStringGetTextDatum(query_text);
+	values[Anum_sr_plans_plan - 1] = PointerGetDatum(plan);
+	values[Anum_sr_plans_enable - 1] = BoolGetDatum(enable);
+	values[Anum_sr_plans_valid - 1] = BoolGetDatum(true);
+	values[Anum_sr_plans_hits - 1] = Int64GetDatum(0);
+	nulls[Anum_sr_plans_last_hit - 1] = true;
+	values[Anum_sr_plans_deps - 1] = PointerGetDatum(sr_plan_make_deps(pl_stmt->relationOids));
+	values[Anum_sr_plans_expires - 1] = TimestampTzGetDatum(expires);
+	nulls[Anum_sr_plans_expires - 1] = (expires == 0);
+	values[Anum_sr_plans_shape_hash - 1] = Int32GetDatum(shape_hash);
+	nulls[Anum_sr_plans_reason - 1] = true;
+	values[Anum_sr_plans_template - 1] = PointerGetDatum(template);
+	nulls[Anum_sr_plans_template - 1] = (template == NULL);
+	values[Anum_sr_plans_settings - 1] = PointerGetDatum(sr_plan_current_settings());
+	nulls[Anum_sr_plans_settings - 1] = (DatumGetPointer(values[Anum_sr_plans_settings - 1]) == NULL);
+	values[Anum_sr_plans_profile - 1] = CStringGetTextDatum(sr_plan_profile);
+
+	tuple = heap_form_tuple(sr_plans_heap->rd_att, values, nulls);
+	simple_heap_insert(sr_plans_heap, tuple);
+	index_insert(query_index_rel,
+				 values, nulls,
+				 &(tuple->t_self),
+				 sr_plans_heap,
+#if PG_VERSION_NUM >= 100000
+				 UNIQUE_CHECK_NO, indexInfo);
+#else
+				 UNIQUE_CHECK_NO);
+#endif
+}
+
+/*
+ * Enable plan found in sr_plans by the plan cache and extend its TTL.
+ */
+static void
+sr_plans_refresh_plan(Relation sr_plans_heap, Relation query_index_rel,
+					  HeapTuple tuple, PlannedStmt *pl_stmt, TimestampTz expires)
+{
+	Datum		values[Natts_sr_plans];
+	bool		nulls[Natts_sr_plans];
+	bool		replaces[Natts_sr_plans];
+	HeapTuple	newtuple;
+
+	memset(replaces, false, sizeof(replaces));
+	memset(nulls, false, sizeof(nulls));
+	values[Anum_sr_plans_enable - 1] = BoolGetDatum(true);
+	replaces[Anum_sr_plans_enable - 1] = true;
+	values[Anum_sr_plans_valid - 1] = BoolGetDatum(true);
+	replaces[Anum_sr_plans_valid - 1] = true;
+	values[Anum_sr_plans_deps - 1] = PointerGetDatum(sr_plan_make_deps(pl_stmt->relationOids));
+	/* Template depends on relations of the schema it was captured in */
+	replaces[Anum_sr_plans_deps - 1] = heap_attisnull(tuple, Anum_sr_plans_template);
+	values[Anum_sr_plans_expires - 1] = TimestampTzGetDatum(expires);
+	replaces[Anum_sr_plans_expires - 1] = true;
+
+	newtuple = heap_modify_tuple(tuple, RelationGetDescr(sr_plans_heap),
+								 values, nulls, replaces);
+	simple_heap_update(sr_plans_heap, &tuple->t_self, newtuple);
+
+	/* Non-HOT update needs a new index entry */
+	if (!HeapTupleIsHeapOnly(newtuple))
+	{
+		bool	isnull;
+#if PG_VERSION_NUM >= 100000
+		IndexInfo  *indexInfo = BuildIndexInfo(query_index_rel);
+#endif
+
+		values[0] = heap_getattr(newtuple, Anum_sr_plans_query_hash,
+								 RelationGetDescr(sr_plans_heap), &isnull);
+		nulls[0] = false;
+		index_insert(query_index_rel,
+					 values, nulls,
+					 &(newtuple->t_self),
+					 sr_plans_heap,
+#if PG_VERSION_NUM >= 100000
+					 UNIQUE_CHECK_NO, indexInfo);
+#else
+					 UNIQUE_CHECK_NO);
+#endif
+	}
+}
+
+/*
+ * Remember that query_hash was planned with a plan of shape_hash.
+ * A new shape of a known query is logged, so plan changes can be noticed.
+ * The plan is kept, so that it can be pinned by sr_plan_pin_shape().
+ */
+static void
+sr_plans_history_record(Oid schema_oid, int32 query_hash,
+						int32 shape_hash, int32 plan_hash,
+						Jsonb *plan, PlannedStmt *pl_stmt)
+{
+	Oid			history_oid;
+	Oid			history_index_oid;
+	Relation	history_heap;
+	Relation	history_index;
+	IndexScanDesc history_scan;
+	ScanKeyData keys[2];
+	HeapTuple	tuple;
+	Datum		values[Natts_sr_plans_history];
+	bool		nulls[Natts_sr_plans_history];
+	bool		known_query = false;
+	bool		found = false;
+	TimestampTz	now = GetCurrentTimestamp();
+
+	history_oid = sr_get_relname_oid(schema_oid, SR_PLANS_HISTORY_TABLE_NAME);
+	history_index_oid = sr_get_relname_oid(schema_oid, SR_PLANS_HISTORY_INDEX_NAME);
+	if (!OidIsValid(history_oid) || !OidIsValid(history_index_oid))
+		return;
+
+	/* Another session is recording the same shape */
+	if (!sr_plan_try_lock(query_hash, shape_hash, SR_PLAN_LOCK_HISTORY))
+		return;
+
+	history_heap = heap_open(history_oid, RowExclusiveLock);
+	if (RelationGetDescr(history_heap)->natts != Natts_sr_plans_history)
+	{
+		heap_close(history_heap, RowExclusiveLock);
+		elog(WARNING, "Unexpected format of %s table, try ALTER EXTENSION sr_plan UPDATE",
+			 SR_PLANS_HISTORY_TABLE_NAME);
+		return;
+	}
+	history_index = index_open(history_index_oid, RowExclusiveLock);
+
+	ScanKeyInit(&keys[0],
+				1,
+				BTEqualStrategyNumber,
+				F_INT4EQ,
+				Int32GetDatum(query_hash));
+	ScanKeyInit(&keys[1],
+				2,
+				BTEqualStrategyNumber,
+				F_INT4EQ,
+				Int32GetDatum(shape_hash));
+
+	/* Look for any shape of the query first, then for this shape */
+	history_scan = index_beginscan(history_heap, history_index,
+								   SnapshotSelf, 2, 0);
+	index_rescan(history_scan, keys, 1, NULL, 0);
+	if (index_getnext(history_scan, ForwardScanDirection) != NULL)
+	{
+		known_query = true;
+		index_rescan(history_scan, keys, 2, NULL, 0);
+		tuple = index_getnext(history_scan, ForwardScanDirection);
+		if (tuple != NULL)
+		{
+			bool		replaces[Natts_sr_plans_history];
+			bool		isnull;
+			TimestampTz	last_seen;
+
+			found = true;
+			last_seen = DatumGetTimestampTz(heap_getattr(tuple,
+											Anum_sr_plans_history_last_seen,
+											RelationGetDescr(history_heap),
+											&isnull));
+
+			/* Don't update the row on every planning */
+			if (isnull || TimestampDifferenceExceeds(last_seen, now, 60 * 1000))
+			{
+				HeapTuple	newtuple;
+
+				memset(replaces, false, sizeof(replaces));
+				memset(nulls, false, sizeof(nulls));
+				values[Anum_sr_plans_history_last_seen - 1] = TimestampTzGetDatum(now);
+				replaces[Anum_sr_plans_history_last_seen - 1] = true;
+				newtuple = heap_modify_tuple(tuple, RelationGetDescr(history_heap),
+											 values, nulls, replaces);
+				simple_heap_update(history_heap, &tuple->t_self, newtuple);
+
+				if (!HeapTupleIsHeapOnly(newtuple))
+				{
+#if PG_VERSION_NUM >= 100000
+					IndexInfo  *indexInfo = BuildIndexInfo(history_index);
+#endif
+
+					values[0] = Int32GetDatum(query_hash);
+					values[1] = Int32GetDatum(shape_hash);
+					index_insert(history_index,
+								 values, nulls,
+								 &(newtuple->t_self),
+								 history_heap,
+#if PG_VERSION_NUM >= 100000
+								 UNIQUE_CHECK_YES, indexInfo);
+#else
+								 UNIQUE_CHECK_YES);
+#endif
+				}
+			}
+		}
+	}
+	index_endscan(history_scan);
+
+	if (!found)
+	{
+#if PG_VERSION_NUM >= 100000
+		IndexInfo  *indexInfo = BuildIndexInfo(history_index);
+#endif
+
+		if (known_query)
+			elog(LOG, "Plan of query %d changed its shape to %d.",
+				 query_hash, shape_hash);
+
+		memset(nulls, false, sizeof(nulls));
+		values[Anum_sr_plans_history_query_hash - 1] = Int32GetDatum(query_hash);
+		values[Anum_sr_plans_history_shape_hash - 1] = Int32GetDatum(shape_hash);
+		values[Anum_sr_plans_history_plan_hash - 1] = Int32GetDatum(plan_hash);
+		values[Anum_sr_plans_history_first_seen - 1] = TimestampTzGetDatum(now);
+		values[Anum_sr_plans_history_last_seen - 1] = TimestampTzGetDatum(now);
+		values[Anum_sr_plans_history_query - 1] = CStringGetTextDatum(query_text);
+		values[Anum_sr_plans_history_plan - 1] = PointerGetDatum(plan);
+		values[Anum_sr_plans_history_deps - 1] = PointerGetDatum(sr_plan_make_deps(pl_stmt->relationOids));
+
+		tuple = heap_form_tuple(history_heap->rd_att, values, nulls);
+		simple_heap_insert(history_heap, tuple);
+		index_insert(history_index,
+					 values, nulls,
+					 &(tuple->t_self),
+					 history_heap,
+#if PG_VERSION_NUM >= 100000
+					 UNIQUE_CHECK_YES, indexInfo);
+#else
+					 UNIQUE_CHECK_YES);
+#endif
+	}
+
+	index_close(history_index, RowExclusiveLock);
+	heap_close(history_heap, RowExclusiveLock);
+}
+
+/*
+ * Plan query with planner settings saved with its plan, they are
+ * in effect only while the query is planned. NULL if settings can't be
+ * applied, or sr_plan.replay_verify is set and the new plan has another
+ * shape than the saved one.
+ */
+static PlannedStmt *
+sr_plan_replay(Query *parse, int cursorOptions, ParamListInfo boundParams,
+			   Jsonb *settings, int32 shape_hash)
+{
+	PlannedStmt	   *pl_stmt;
+	int				nest_level;
+
+	/* Planner scribbles on the query, keep it for the saved plan */
+	if (sr_plan_replay_verify)
+		parse = (Query *) copyObject(parse);
+
+	nest_level = NewGUCNestLevel();
+	if (!sr_plan_apply_settings(settings, PGC_S_SESSION, GUC_ACTION_SAVE))
+	{
+		AtEOXact_GUC(true, nest_level);
+		return NULL;
+	}
+	pl_stmt = call_next_planner(parse, cursorOptions, boundParams);
+	AtEOXact_GUC(true, nest_level);
+
+	if (sr_plan_replay_verify &&
+		sr_plan_shape_hash(node_tree_to_jsonb(pl_stmt, 0, false)) != shape_hash)
+		return NULL;
+
+	return pl_stmt;
+}
+
 PlannedStmt *sr_planner(Query *parse,
 						int cursorOptions,
 						ParamListInfo boundParams)
 {
-	PlannedStmt *pl_stmt;
-	Jsonb *out_jsonb;
-	Jsonb *out_jsonb2;
+	PlannedStmt *pl_stmt = NULL;
+	Jsonb *out_jsonb2 = NULL;
+	Jsonb *saved_plan;
 	int query_hash;
 	Relation sr_plans_heap;
 	Relation query_index_rel;
-	HeapTuple tuple;
-	/* For make new tuple */
-	Datum		values[6];
-	static bool nulls[6] = {false, false, false, false, false, false};
 	/* For search tuple */
-	Datum		search_values[6];
-	static bool search_nulls[6] = {false, false, false, false, false, false};
+	Datum		search_values[Natts_sr_plans];
+	bool		search_nulls[Natts_sr_plans];
 	bool find_ok = false;
+	/* Plan of default profile, used if the current profile has none */
+	HeapTuple default_plan = NULL;
+	/* Plan of the current profile */
+	HeapTuple found_plan = NULL;
+	int32 profile_hash = sr_plan_profile_hash(sr_plan_profile);
+	SrPlanBinding *binding = NULL;
+	/* Set when the query was planned instead of using a stored plan */
+	bool planned = false;
+	Datum plan_hash = 0;
+	int32 shape_hash = 0;
+	/* Query has a plan stored in the current profile, used in capture-once mode */
+	bool have_plan = false;
+	/* Plans may be added only if we are allowed to write */
+	bool auto_cache = (sr_plan_auto_cache_threshold >= 0 &&
+					   boundParams == NULL &&
+					   !RecoveryInProgress() &&
+					   !XactReadOnly);
 	LOCKMODE heap_lock = AccessShareLock;
 	Oid query_index_rel_oid;
 	Oid	sr_plans_oid;
 	Oid	schema_oid;
-	char *schema_name;
 	IndexScanDesc query_index_scan;
 	ScanKeyData key;
-	List *func_name_list;
+	TimestampTz now = GetCurrentTransactionStartTimestamp();
 
-#if PG_VERSION_NUM >= 100000
-	IndexInfo *indexInfo;
-#endif
+	if (sr_plan_bypass)
+		return call_next_planner(parse, cursorOptions, boundParams);
 
-	if(sr_plan_write_mode)
+	/* Plans captured on hot standby are spooled instead of inserted */
+	if((sr_plan_write_mode && !RecoveryInProgress()) || auto_cache)
 		heap_lock = RowExclusiveLock;
 
 	schema_oid = get_sr_plan_schema();
@@ -167,27 +644,7 @@ PlannedStmt *sr_planner(Query *parse,
 		return call_next_planner(parse, cursorOptions, boundParams);
 	}
 
-	if(sr_plan_fake_func)
-	{
-		HeapTuple   ftup;
-		ftup = SearchSysCache1(PROCOID, ObjectIdGetDatum(sr_plan_fake_func));
-		if(!HeapTupleIsValid(ftup)) sr_plan_fake_func = 0;
-		else ReleaseSysCache(ftup);
-	}
-
-	if (!sr_plan_fake_func)
-	{
-		Oid args[1] = {ANYELEMENTOID};
-
-		schema_name = get_namespace_name(schema_oid);
-		func_name_list = list_make2(makeString(schema_name), makeString("_p"));
-		sr_plan_fake_func = LookupFuncName(func_name_list, 1, args, true);
-		list_free(func_name_list);
-		pfree(schema_name);
-	}
-
-	out_jsonb = node_tree_to_jsonb(parse, sr_plan_fake_func, true);
-	query_hash = DatumGetInt32(DirectFunctionCall1(jsonb_hash, PointerGetDatum(out_jsonb)));
+	query_hash = sr_plan_query_hash(parse, schema_oid);
 
 	query_params = NULL;
 	/* Make list with all _p functions and his position */
@@ -202,6 +659,14 @@ PlannedStmt *sr_planner(Query *parse,
 	/* Table "sr_plans" exists */
 	sr_plans_heap = heap_open(sr_plans_oid, heap_lock);
 
+	if (RelationGetDescr(sr_plans_heap)->natts != Natts_sr_plans)
+	{
+		heap_close(sr_plans_heap, heap_lock);
+		elog(WARNING, "Unexpected format of %s table, try ALTER EXTENSION sr_plan UPDATE",
+			 SR_PLANS_TABLE_NAME);
+		return call_next_planner(parse, cursorOptions, boundParams);
+	}
+
 	query_index_rel_oid = sr_get_relname_oid(schema_oid, SR_PLANS_TABLE_QUERY_INDEX_NAME);
 
 	if (query_index_rel_oid == InvalidOid)
@@ -213,10 +678,6 @@ PlannedStmt *sr_planner(Query *parse,
 
 	query_index_rel = index_open(query_index_rel_oid, heap_lock);
 
-#if PG_VERSION_NUM >= 100000
-	indexInfo = BuildIndexInfo(query_index_rel);
-#endif
-
 	query_index_scan = index_beginscan(
 				sr_plans_heap,
 				query_index_rel,
@@ -236,6 +697,8 @@ PlannedStmt *sr_planner(Query *parse,
 	for (;;)
 	{
 		HeapTuple local_tuple;
+		bool current_profile;
+
 		local_tuple = index_getnext(query_index_scan, ForwardScanDirection);
 
 		if (local_tuple == NULL) break;
@@ -243,90 +706,243 @@ PlannedStmt *sr_planner(Query *parse,
 		heap_deform_tuple(local_tuple, sr_plans_heap->rd_att,
 						  search_values, search_nulls);
 
+		current_profile = sr_plan_profile_equal(search_values[Anum_sr_plans_profile - 1],
+												sr_plan_profile);
+		if (!current_profile &&
+			!sr_plan_profile_equal(search_values[Anum_sr_plans_profile - 1],
+								   SR_PLAN_DEFAULT_PROFILE))
+			continue;
+
+		if (current_profile)
+			have_plan = true;
+
 		/* Check enabled and validate field */
-		if (DatumGetBool(search_values[4]) &&
-			DatumGetBool(search_values[5])) {
-			find_ok = true;
-			break;
+		if (DatumGetBool(search_values[Anum_sr_plans_enable - 1]) &&
+			DatumGetBool(search_values[Anum_sr_plans_valid - 1]) &&
+			(search_nulls[Anum_sr_plans_expires - 1] ||
+			 DatumGetTimestampTz(search_values[Anum_sr_plans_expires - 1]) > now)) {
+			if (current_profile)
+			{
+				found_plan = heap_copytuple(local_tuple);
+				find_ok = true;
+				break;
+			}
+			if (default_plan == NULL)
+				default_plan = heap_copytuple(local_tuple);
 		}
 	}
 	index_endscan(query_index_scan);
 
+	/* Buffer of the scanned tuple isn't pinned after the scan */
 	if (find_ok)
+		heap_deform_tuple(found_plan, sr_plans_heap->rd_att,
+						  search_values, search_nulls);
+
+	/* In write mode plans are captured for the current profile */
+	if (!find_ok && default_plan != NULL && !sr_plan_write_mode)
 	{
-		elog(LOG, "Ok we find saved plan.");
-		out_jsonb2 = (Jsonb *)DatumGetPointer(PG_DETOAST_DATUM(search_values[3]));
-		if (query_params != NULL)
-			pl_stmt = jsonb_to_node_tree(out_jsonb2, &replace_fake);
+		heap_deform_tuple(default_plan, sr_plans_heap->rd_att,
+						  search_values, search_nulls);
+		profile_hash = sr_plan_profile_hash(SR_PLAN_DEFAULT_PROFILE);
+		find_ok = true;
+	}
+
+	/* Template has to be bound to relations in the current search_path */
+	if (find_ok && !search_nulls[Anum_sr_plans_template - 1])
+	{
+		binding = sr_plan_get_binding(query_hash,
+									  DatumGetInt32(search_values[Anum_sr_plans_plan_hash - 1]),
+									  DatumGetJsonb(search_values[Anum_sr_plans_template - 1]));
+		if (binding == NULL)
+		{
+			elog(LOG, "Saved plan template can't be bound, query will be planned.");
+			find_ok = false;
+		}
+		else if (!sr_plan_binding_matches(binding, parse))
+		{
+			elog(LOG, "Saved plan template is bound to other relations than query uses, query will be planned.");
+			find_ok = false;
+		}
+	}
+
+	/* Executor has found that the plan is built for other data */
+	if (find_ok && sr_plan_is_disabled(profile_hash, query_hash,
+									   DatumGetInt32(search_values[Anum_sr_plans_plan_hash - 1])))
+	{
+		elog(LOG, "Saved plan misestimates rows, query will be planned.");
+		find_ok = false;
+	}
+
+	if (find_ok)
+	{
+		saved_plan = (Jsonb *)DatumGetPointer(PG_DETOAST_DATUM(search_values[Anum_sr_plans_plan - 1]));
+		shape_hash = search_nulls[Anum_sr_plans_shape_hash - 1] ?
+			sr_plan_shape_hash(saved_plan) :
+			DatumGetInt32(search_values[Anum_sr_plans_shape_hash - 1]);
+
+		/* Query is planned again with the planner settings it was captured with */
+		if (sr_plan_replay_settings && !search_nulls[Anum_sr_plans_settings - 1])
+		{
+			/* Template is compared with the plan bound to the current relations */
+			if (binding != NULL)
+			{
+				load_binding = binding;
+				shape_hash = sr_plan_shape_hash(
+					node_tree_to_jsonb(jsonb_to_node_tree(saved_plan, &sr_plan_load_hook),
+									   0, false));
+			}
+			pl_stmt = sr_plan_replay(parse, cursorOptions, boundParams,
+									 DatumGetJsonb(search_values[Anum_sr_plans_settings - 1]),
+									 shape_hash);
+			if (pl_stmt == NULL)
+				elog(LOG, "Query can't be replayed with saved planner settings, saved plan will be used.");
+		}
+	}
+
+	if (find_ok && pl_stmt == NULL)
+	{
+		load_binding = binding;
+		if (query_params != NULL || binding != NULL)
+			pl_stmt = jsonb_to_node_tree(saved_plan, &sr_plan_load_hook);
 		else
-			pl_stmt = jsonb_to_node_tree(out_jsonb2, NULL);
+			pl_stmt = jsonb_to_node_tree(saved_plan, NULL);
+
+		/* Partitions could be attached or detached after the plan was saved */
+		if (!sr_plan_expand_inheritance(pl_stmt, sr_plan_fake_func))
+		{
+			elog(LOG, "Saved plan doesn't fit current partitions, query will be planned.");
+			find_ok = false;
+		}
+		/* Relations could be altered after the plan was saved */
+		else if (!search_nulls[Anum_sr_plans_deps - 1] &&
+				 !sr_plan_check_deps(DatumGetArrayTypeP(search_values[Anum_sr_plans_deps - 1]),
+									 binding, pl_stmt->relationOids))
+		{
+			elog(LOG, "Saved plan is outdated, query will be planned.");
+			find_ok = false;
+		}
+	}
+
+	if (find_ok)
+	{
+		elog(LOG, "Ok we find saved plan.");
+		sr_plan_record_hit(profile_hash, query_hash,
+						   DatumGetInt32(search_values[Anum_sr_plans_plan_hash - 1]));
+
+		pl_stmt->queryId = parse->queryId;
+		if (sr_plan_feedback_sample_rate > 0)
+			sr_plan_feedback_track(pl_stmt, profile_hash, query_hash,
+								   DatumGetInt32(search_values[Anum_sr_plans_plan_hash - 1]));
+	}
+	/* In capture-once mode we only record the first plan for query_hash */
+	else if (sr_plan_write_mode && sr_plan_capture_once && have_plan)
+	{
+		pl_stmt = call_next_planner(parse, cursorOptions, boundParams);
+		planned = true;
 	}
 	/* Ok, we supported duplicate query_hash but only if all plans with query_hash disabled.*/
 	else if (sr_plan_write_mode)
 	{
-		bool not_have_duplicate = true;
-		Datum plan_hash;
+		HeapTuple duplicate;
 
 		pl_stmt = call_next_planner(parse, cursorOptions, boundParams);
+		planned = true;
 		out_jsonb2 = node_tree_to_jsonb(pl_stmt, 0, false);
 		plan_hash = DirectFunctionCall1(jsonb_hash, PointerGetDatum(out_jsonb2));
+		shape_hash = sr_plan_shape_hash(out_jsonb2);
+
+		/* Plans which differ only in estimates are the same plan */
+		duplicate = sr_plans_find_plan(sr_plans_heap, query_index_rel,
+									   query_hash, DatumGetInt32(plan_hash),
+									   shape_hash, sr_plan_profile, false);
+		/* Stored plan wasn't used, so it isn't counted as a hit */
+		if (duplicate)
+			heap_freetuple(duplicate);
+		else if (RecoveryInProgress())
+			sr_plan_spool_plan(query_hash, DatumGetInt32(plan_hash), shape_hash,
+							   query_text, out_jsonb2, pl_stmt);
+		else
+			sr_plans_insert_plan(sr_plans_heap, query_index_rel,
+								 query_hash, plan_hash, shape_hash,
+								 out_jsonb2, pl_stmt, false, 0);
+	}
+	/* Cache plans of queries which are expensive to plan */
+	else if (auto_cache)
+	{
+		instr_time	planstart,
+					planduration;
 
-		query_index_scan = index_beginscan(sr_plans_heap,
-										   query_index_rel,
-										   SnapshotSelf,
-										   1,
-										   0);
-		index_rescan(query_index_scan,
-					 &key, 1,
-					 NULL, 0);
-		for (;;)
+		INSTR_TIME_SET_CURRENT(planstart);
+		pl_stmt = call_next_planner(parse, cursorOptions, boundParams);
+		INSTR_TIME_SET_CURRENT(planduration);
+		INSTR_TIME_SUBTRACT(planduration, planstart);
+		planned = true;
+
+		/* Plan of the query is cached by one session at a time */
+		if (INSTR_TIME_GET_MILLISEC(planduration) >= sr_plan_auto_cache_threshold &&
+			sr_plan_try_lock(query_hash, sr_plan_profile_hash(sr_plan_profile),
+							 SR_PLAN_LOCK_AUTO_CACHE))
 		{
-			HeapTuple local_tuple;
-			ItemPointer tid = index_getnext_tid(query_index_scan, ForwardScanDirection);
-			if (tid == NULL)
-				break;
-
-			local_tuple = index_fetch_heap(query_index_scan);
-			heap_deform_tuple(local_tuple, sr_plans_heap->rd_att,
-							  search_values, search_nulls);
-
-			/* Detect full plan duplicate */
-			if (search_values[1] == plan_hash)
+			HeapTuple expired;
+			TimestampTz expires;
+
+			out_jsonb2 = node_tree_to_jsonb(pl_stmt, 0, false);
+			plan_hash = DirectFunctionCall1(jsonb_hash, PointerGetDatum(out_jsonb2));
+			shape_hash = sr_plan_shape_hash(out_jsonb2);
+			expires = TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+												  sr_plan_auto_cache_ttl * 1000L);
+
+			/* Plan may be stored already if it has expired */
+			expired = sr_plans_find_plan(sr_plans_heap, query_index_rel,
+										 query_hash, DatumGetInt32(plan_hash),
+										 shape_hash, sr_plan_profile, false);
+			if (expired)
 			{
-				not_have_duplicate = false;
-				break;
+				bool isnull;
+
+				/*
+				 * Don't touch plans which weren't added by plan cache
+				 * or were disabled by executor feedback
+				 */
+				heap_getattr(expired, Anum_sr_plans_expires,
+							 RelationGetDescr(sr_plans_heap), &isnull);
+				if (!isnull && heap_attisnull(expired, Anum_sr_plans_reason))
+					sr_plans_refresh_plan(sr_plans_heap, query_index_rel,
+										  expired, pl_stmt, expires);
 			}
-		}
-		index_endscan(query_index_scan);
-
-		if (not_have_duplicate)
-		{
-			values[0] = Int32GetDatum(query_hash);
-			values[1] = plan_hash;
-			values[2] = CStringGetTextDatum(query_text);
-			values[3] = PointerGetDatum(out_jsonb2);
-			values[4] = BoolGetDatum(false);
-			values[5] = BoolGetDatum(true);
-			tuple = heap_form_tuple(sr_plans_heap->rd_att, values, nulls);
-			simple_heap_insert(sr_plans_heap, tuple);
-			index_insert(query_index_rel,
-						 values, nulls,
-						 &(tuple->t_self),
-						 sr_plans_heap,
-#if PG_VERSION_NUM >= 100000
-						 UNIQUE_CHECK_NO, indexInfo);
-#else
-						 UNIQUE_CHECK_NO);
-#endif
+			else
+				sr_plans_insert_plan(sr_plans_heap, query_index_rel,
+									 query_hash, plan_hash, shape_hash,
+									 out_jsonb2, pl_stmt, true, expires);
 		}
 	}
 	else
 	{
 		pl_stmt = call_next_planner(parse, cursorOptions, boundParams);
+		planned = true;
 	}
 
 	index_close(query_index_rel, heap_lock);
 	heap_close(sr_plans_heap, heap_lock);
+
+	/*
+	 * Remember shapes of new plans to show when plan of a query flips.
+	 * History can't be written in read-only transactions and parallel mode.
+	 */
+	if (planned && (out_jsonb2 != NULL || sr_plan_track_shapes) &&
+		!RecoveryInProgress() && !XactReadOnly && !IsInParallelMode())
+	{
+		if (out_jsonb2 == NULL)
+		{
+			out_jsonb2 = node_tree_to_jsonb(pl_stmt, 0, false);
+			plan_hash = DirectFunctionCall1(jsonb_hash, PointerGetDatum(out_jsonb2));
+			shape_hash = sr_plan_shape_hash(out_jsonb2);
+		}
+
+		sr_plans_history_record(schema_oid, query_hash, shape_hash,
+								DatumGetInt32(plan_hash), out_jsonb2, pl_stmt);
+	}
+
 	return pl_stmt;
 }
 
@@ -388,6 +1004,20 @@ void *replace_fake(void *node)
 	return node;
 }
 
+/*
+ * Substitute parameters and relations of template into loaded plan.
+ */
+static void *
+sr_plan_load_hook(void *node)
+{
+	if (query_params != NULL)
+		node = replace_fake(node);
+	if (load_binding != NULL)
+		node = sr_plan_bind_node(node, load_binding);
+
+	return node;
+}
+
 void _PG_init(void) {
 	DefineCustomBoolVariable("sr_plan.write_mode",
 							 "Save all plans for all query.",
@@ -400,6 +1030,205 @@ void _PG_init(void) {
 							 NULL,
 							 NULL);
 
+	DefineCustomBoolVariable("sr_plan.capture_once",
+							 "Save only the first plan for each query in write mode.",
+							 NULL,
+							 &sr_plan_capture_once,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("sr_plan.track_shapes",
+							 "Record shapes of all new plans in sr_plans_history.",
+							 "Shapes of plans saved in write mode or by plan cache are always recorded.",
+							 &sr_plan_track_shapes,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("sr_plan.max_plans",
+							"Max number of plans kept in sr_plans, 0 means no limit.",
+							"Only disabled plans are evicted.",
+							&sr_plan_max_plans,
+							0,
+							0,
+							INT_MAX,
+							PGC_SUSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomEnumVariable("sr_plan.eviction_policy",
+							 "Which disabled plans are evicted first.",
+							 NULL,
+							 &sr_plan_eviction_policy,
+							 SR_PLAN_EVICT_LAST_HIT,
+							 eviction_policy_options,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("sr_plan.maintenance_naptime",
+							"Sleep time between runs of sr_plan maintenance worker.",
+							NULL,
+							&sr_plan_maintenance_naptime,
+							60,
+							1,
+							INT_MAX / 1000,
+							PGC_SIGHUP,
+							GUC_UNIT_S,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomStringVariable("sr_plan.maintenance_database",
+							   "Database where sr_plan maintenance worker runs.",
+							   "Worker is not started if empty.",
+							   &sr_plan_maintenance_database,
+							   "",
+							   PGC_POSTMASTER,
+							   0,
+							   NULL,
+							   NULL,
+							   NULL);
+
+	DefineCustomIntVariable("sr_plan.auto_cache_threshold",
+							"Save and enable plans of queries which take longer to plan.",
+							"-1 disables plan cache.",
+							&sr_plan_auto_cache_threshold,
+							-1,
+							-1,
+							INT_MAX,
+							PGC_SUSET,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("sr_plan.auto_cache_ttl",
+							"Time to live of plans saved by plan cache.",
+							NULL,
+							&sr_plan_auto_cache_ttl,
+							3600,
+							1,
+							INT_MAX / 1000,
+							PGC_SUSET,
+							GUC_UNIT_S,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("sr_plan.template_mode",
+							 "Save and look up plans as templates bound to relations by name.",
+							 "Template captured in one schema is used for relations with the same names in any schema in search_path.",
+							 &sr_plan_template_mode,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomStringVariable("sr_plan.profile",
+							   "Profile of saved plans used and captured by the session.",
+							   "Plans of \"" SR_PLAN_DEFAULT_PROFILE "\" profile are used if the profile has no plan for a query.",
+							   &sr_plan_profile,
+							   SR_PLAN_DEFAULT_PROFILE,
+							   PGC_USERSET,
+							   0,
+							   NULL,
+							   NULL,
+							   NULL);
+
+	DefineCustomBoolVariable("sr_plan.replay_settings",
+							 "Plan queries again with planner settings saved with their plans.",
+							 "Saved plan is used only if the query was captured without non-default planner settings.",
+							 &sr_plan_replay_settings,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("sr_plan.replay_verify",
+							 "Check that plan made with saved planner settings has the shape of saved plan.",
+							 "Saved plan is used if shapes differ.",
+							 &sr_plan_replay_verify,
+							 true,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomRealVariable("sr_plan.feedback_sample_rate",
+							 "Fraction of executions of saved plans checked for row misestimates.",
+							 "Saved plan is disabled if its estimates are wrong in several checks in a row.",
+							 &sr_plan_feedback_sample_rate,
+							 0.0,
+							 0.0,
+							 1.0,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomRealVariable("sr_plan.feedback_threshold",
+							 "Ratio between estimated and actual rows of a plan node considered a misestimate.",
+							 NULL,
+							 &sr_plan_feedback_threshold,
+							 100.0,
+							 1.0,
+							 DBL_MAX,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("sr_plan.feedback_min_samples",
+							"Number of misestimating executions in a row which disable saved plan.",
+							NULL,
+							&sr_plan_feedback_min_samples,
+							3,
+							1,
+							INT_MAX,
+							PGC_SUSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("sr_plan.max_spool_size",
+							"Max size of spool file with plans captured on hot standby.",
+							"Plans aren't spooled while the file is larger.",
+							&sr_plan_max_spool_size,
+							10240,
+							0,
+							MAX_KILOBYTES,
+							PGC_SIGHUP,
+							GUC_UNIT_KB,
+							NULL,
+							NULL,
+							NULL);
+
+	if (process_shared_preload_libraries_in_progress)
+	{
+		sr_plan_shmem_request();
+		sr_plan_register_maintenance_worker();
+	}
+
 	if (planner_hook)
 		planner_hook_next = planner_hook;
 
@@ -408,6 +1237,7 @@ void _PG_init(void) {
 
 	planner_hook = &sr_planner;
 	post_parse_analyze_hook = &sr_analyze;
+	sr_plan_feedback_install_hooks();
 }
 
 PG_FUNCTION_INFO_V1(_p);
@@ -478,9 +1308,9 @@ sr_plan_invalid_table(PG_FUNCTION_ARGS)
 	ExprContext econtext;
 	TupleTableSlot *slot = NULL;
 	Relation sr_plans_heap;
-	Datum		search_values[6];
-	static bool search_nulls[6];
-	static bool search_replaces[6];
+	Datum		search_values[Natts_sr_plans];
+	static bool search_nulls[Natts_sr_plans];
+	static bool search_replaces[Natts_sr_plans];
 	Oid sr_plans_oid;
 	HeapScanDesc heapScan;
 	Jsonb *jsonb;
@@ -497,6 +1327,13 @@ sr_plan_invalid_table(PG_FUNCTION_ARGS)
 		elog(ERROR, "Cannot find %s table", SR_PLANS_TABLE_NAME);
 	}
 	sr_plans_heap = heap_open(sr_plans_oid, RowExclusiveLock);
+	if (RelationGetDescr(sr_plans_heap)->natts != Natts_sr_plans)
+	{
+		heap_close(sr_plans_heap, RowExclusiveLock);
+		elog(WARNING, "Unexpected format of %s table, try ALTER EXTENSION sr_plan UPDATE",
+			 SR_PLANS_TABLE_NAME);
+		PG_RETURN_NULL();
+	}
 
 	relation_key.type = jbvString;
 	relation_key.val.string.len = strlen("relationOids");
@@ -549,14 +1386,16 @@ sr_plan_invalid_table(PG_FUNCTION_ARGS)
 			heap_deform_tuple(local_tuple, sr_plans_heap->rd_att,
 							  search_values, search_nulls);
 
-			if (DatumGetBool(search_values[5])) {
+			/* Templates are bound by names, they are valid for other schemas */
+			if (DatumGetBool(search_values[Anum_sr_plans_valid - 1]) &&
+				search_nulls[Anum_sr_plans_template - 1]) {
 				int type;
 				JsonbValue v;
 				JsonbIterator *it;
 				JsonbValue *node_relation;
 				HeapTuple newtuple;
 
-				jsonb = (Jsonb *)DatumGetPointer(PG_DETOAST_DATUM(search_values[3]));
+				jsonb = (Jsonb *)DatumGetPointer(PG_DETOAST_DATUM(search_values[Anum_sr_plans_plan - 1]));
 
 				/* TODO: need move to function */
 				if (strcmp(type_name, "table") == 0)
@@ -604,10 +1443,10 @@ sr_plan_invalid_table(PG_FUNCTION_ARGS)
 				}
 				if (find_plan)
 				{
-					elog(WARNING, "Invalidate saved plan with query:\n\t%s", TextDatumGetCString(search_values[2]));
+					elog(WARNING, "Invalidate saved plan with query:\n\t%s", TextDatumGetCString(search_values[Anum_sr_plans_query - 1]));
 					/* update existing entry */
-					search_values[5] = BoolGetDatum(false);
-					search_replaces[5] = true;
+					search_values[Anum_sr_plans_valid - 1] = BoolGetDatum(false);
+					search_replaces[Anum_sr_plans_valid - 1] = true;
 
 					newtuple = heap_modify_tuple(local_tuple, RelationGetDescr(sr_plans_heap),
 										 search_values, search_nulls, search_replaces);
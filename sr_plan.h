@@ -15,11 +15,15 @@
 #include "utils/tqual.h"
 #include "utils/guc.h"
 #include "utils/datum.h"
+#include "utils/array.h"
 #include "utils/inval.h"
 #include "utils/snapmgr.h"
 #include "utils/fmgroids.h"
 #include "portability/instr_time.h"
 #include "storage/lock.h"
+#include "storage/lwlock.h"
+#include "storage/spin.h"
+#include "utils/timestamp.h"
 #include "access/heapam.h"
 #include "access/htup_details.h"
 #include "parser/analyze.h"
@@ -32,6 +36,178 @@
 
 #define SR_PLANS_TABLE_NAME	"sr_plans"
 #define SR_PLANS_TABLE_QUERY_INDEX_NAME	"sr_plans_query_hash_idx"
+#define SR_PLANS_HISTORY_TABLE_NAME	"sr_plans_history"
+#define SR_PLANS_HISTORY_INDEX_NAME	"sr_plans_history_query_hash_idx"
+
+/* Attribute numbers of "sr_plans" table */
+#define Anum_sr_plans_query_hash	1
+#define Anum_sr_plans_plan_hash		2
+#define Anum_sr_plans_query			3
+#define Anum_sr_plans_plan			4
+#define Anum_sr_plans_enable		5
+#define Anum_sr_plans_valid			6
+#define Anum_sr_plans_hits			7
+#define Anum_sr_plans_last_hit		8
+#define Anum_sr_plans_deps			9
+#define Anum_sr_plans_expires		10
+#define Anum_sr_plans_shape_hash	11
+#define Anum_sr_plans_reason		12
+#define Anum_sr_plans_template		13
+#define Anum_sr_plans_settings		14
+#define Anum_sr_plans_profile		15
+
+#define Natts_sr_plans				15
+
+/* Plans of this profile are used if the current profile has none */
+#define SR_PLAN_DEFAULT_PROFILE		"default"
+
+/* Attribute numbers of "sr_plans_history" table */
+#define Anum_sr_plans_history_query_hash	1
+#define Anum_sr_plans_history_shape_hash	2
+#define Anum_sr_plans_history_plan_hash		3
+#define Anum_sr_plans_history_first_seen	4
+#define Anum_sr_plans_history_last_seen		5
+#define Anum_sr_plans_history_query			6
+#define Anum_sr_plans_history_plan			7
+#define Anum_sr_plans_history_deps			8
+
+#define Natts_sr_plans_history				8
+
+/* Max number of (query_hash, plan_hash) pairs with pending hit counters */
+#define SR_PLAN_STATS_MAX			8192
+
+/* Size of message queue of each batch capture worker */
+#define SR_PLAN_CAPTURE_QUEUE_SIZE	65536
+
+typedef enum
+{
+	SR_PLAN_EVICT_LAST_HIT,		/* evict least recently used plans first */
+	SR_PLAN_EVICT_HITS			/* evict least frequently used plans first */
+} SrPlanEvictionPolicy;
+
+/* Stats table is shared by all databases of the cluster */
+typedef struct SrPlanStatsKey
+{
+	Oid			database_id;
+	int32		profile_hash;	/* sr_plan_profile_hash() of plan's profile */
+	int32		query_hash;
+	int32		plan_hash;
+} SrPlanStatsKey;
+
+typedef struct SrPlanStatsEntry
+{
+	SrPlanStatsKey	key;
+	slock_t			mutex;		/* protects the counters below */
+	int64			hits;
+	TimestampTz		last_hit;
+	int				bad_samples;	/* misestimated executions in a row */
+	double			max_error;		/* worst misestimate among them */
+	bool			disabled;		/* disabled by executor feedback */
+	TransactionId	flush_xid;		/* transaction which wrote disabled plan */
+} SrPlanStatsEntry;
+
+/* Plan captured outside of "sr_plans" to be stored by sr_plan_store_plans() */
+typedef struct SrPlanCaptured
+{
+	int32		query_hash;
+	int32		plan_hash;
+	int32		shape_hash;
+	text	   *query;
+	Jsonb	   *plan;
+	ArrayType  *deps;
+	Jsonb	   *template;
+	Jsonb	   *settings;
+	char	   *profile;
+} SrPlanCaptured;
+
+/* Mapping of template relations to relations in the current search_path */
+typedef struct SrPlanBinding
+{
+	int			nrels;
+	Oid		   *from;
+	Oid		   *to;
+} SrPlanBinding;
+
+/* sr_plan.c */
+extern int	sr_plan_max_plans;
+extern int	sr_plan_eviction_policy;
+extern int	sr_plan_maintenance_naptime;
+extern char *sr_plan_maintenance_database;
+extern int	sr_plan_auto_cache_threshold;
+extern int	sr_plan_auto_cache_ttl;
+extern bool	sr_plan_bypass;
+extern bool	sr_plan_capture_once;
+extern bool	sr_plan_track_shapes;
+extern double sr_plan_feedback_sample_rate;
+extern double sr_plan_feedback_threshold;
+extern int	sr_plan_feedback_min_samples;
+extern int	sr_plan_max_spool_size;
+extern bool	sr_plan_template_mode;
+extern bool	sr_plan_replay_settings;
+extern bool	sr_plan_replay_verify;
+extern char *sr_plan_profile;
+extern Oid	sr_plan_fake_func;
+
+Oid get_sr_plan_schema(void);
+int32 sr_plan_query_hash(Query *parse, Oid schema_oid);
+HeapTuple sr_plans_find_plan(Relation sr_plans_heap, Relation query_index_rel,
+							 int32 query_hash, int32 plan_hash, int32 shape_hash,
+							 const char *profile, bool any_plan);
+
+/* fingerprint.c */
+uint32 sr_plan_jsonb_hash(Jsonb *jsonb, const char *const *ignored_keys);
+int32 sr_plan_shape_hash(Jsonb *plan);
+int32 sr_plan_template_hash(Query *parse, Oid fake_func);
+
+/* shmem.c */
+void sr_plan_shmem_request(void);
+LWLock *sr_plan_spool_lock(void);
+uint32 sr_plan_spool_generation(void);
+void sr_plan_spool_next_generation(void);
+int32 sr_plan_profile_hash(const char *profile);
+void sr_plan_record_hit(int32 profile_hash, int32 query_hash, int32 plan_hash);
+void sr_plan_record_feedback(int32 profile_hash, int32 query_hash, int32 plan_hash,
+							 double error);
+bool sr_plan_is_disabled(int32 profile_hash, int32 query_hash, int32 plan_hash);
+SrPlanStatsEntry *sr_plan_drain_stats(int *nentries);
+
+/* validate.c */
+ArrayType *sr_plan_make_deps(List *relationOids);
+bool sr_plan_check_deps(ArrayType *deps, SrPlanBinding *binding, List *relids);
+
+/* inherit.c */
+bool sr_plan_expand_inheritance(PlannedStmt *pl_stmt, Oid fake_func);
+
+/* template.c */
+Jsonb *sr_plan_make_template(PlannedStmt *pl_stmt, Oid fake_func);
+SrPlanBinding *sr_plan_get_binding(int32 query_hash, int32 plan_hash,
+								   Jsonb *template);
+Oid sr_plan_bound_oid(SrPlanBinding *binding, Oid relid);
+bool sr_plan_binding_matches(SrPlanBinding *binding, Query *parse);
+void *sr_plan_bind_node(void *node, SrPlanBinding *binding);
+
+/* feedback.c */
+void sr_plan_feedback_install_hooks(void);
+void sr_plan_feedback_track(PlannedStmt *pl_stmt, int32 profile_hash,
+							int32 query_hash, int32 plan_hash);
+
+/* settings.c */
+bool sr_plan_apply_settings(Jsonb *settings, GucSource source, GucAction action);
+void sr_plan_check_settings(Jsonb *settings);
+Jsonb *sr_plan_current_settings(void);
+
+/* capture.c */
+PGDLLEXPORT void sr_plan_capture_main(Datum main_arg);
+int sr_plan_store_plans(Oid schema_oid, List *captured);
+
+/* spool.c */
+void sr_plan_spool_plan(int32 query_hash, int32 plan_hash, int32 shape_hash,
+						const char *query, Jsonb *plan, PlannedStmt *pl_stmt);
+
+/* worker.c */
+void sr_plan_register_maintenance_worker(void);
+int sr_plan_run_maintenance(Oid schema_oid);
+PGDLLEXPORT void sr_plan_maintenance_main(Datum main_arg);
 
 Jsonb *node_tree_to_jsonb(const void *obj, Oid fake_func, bool skip_location_from_node);
 void *jsonb_to_node_tree(Jsonb *json, void *(*hookPtr) (void *));
@@ -0,0 +1,455 @@
+#include "sr_plan.h"
+#include "catalog/namespace.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/syscache.h"
+
+/* Binding of template plan is cached for each search_path */
+typedef struct SrPlanBindingKey
+{
+	int32		query_hash;
+	int32		plan_hash;
+	uint32		search_path_hash;
+} SrPlanBindingKey;
+
+typedef struct SrPlanBindingEntry
+{
+	SrPlanBindingKey key;
+	List	   *search_path;
+	SrPlanBinding *binding;		/* NULL if template can't be bound */
+} SrPlanBindingEntry;
+
+static MemoryContext bindings_cxt = NULL;
+static HTAB *bindings = NULL;
+
+static void sr_plan_bindings_reset(Datum arg, int cacheid, uint32 hashvalue);
+
+static void
+sr_plan_add_template_rel(JsonbParseState **state, Oid relid, Oid table_relid)
+{
+	JsonbValue	v;
+	char	   *relname = get_rel_name(relid);
+	char	   *key;
+
+	if (relname == NULL)
+		return;
+
+	key = psprintf("%u", relid);
+	v.type = jbvString;
+	v.val.string.val = key;
+	v.val.string.len = strlen(key);
+	pushJsonbValue(state, WJB_KEY, &v);
+	pushJsonbValue(state, WJB_BEGIN_OBJECT, NULL);
+
+	v.val.string.val = "name";
+	v.val.string.len = 4;
+	pushJsonbValue(state, WJB_KEY, &v);
+	v.val.string.val = relname;
+	v.val.string.len = strlen(relname);
+	pushJsonbValue(state, WJB_VALUE, &v);
+
+	/* Index is looked up in the schema of its table */
+	if (OidIsValid(table_relid))
+	{
+		char *table = psprintf("%u", table_relid);
+
+		v.val.string.val = "table";
+		v.val.string.len = 5;
+		pushJsonbValue(state, WJB_KEY, &v);
+		v.val.string.val = table;
+		v.val.string.len = strlen(table);
+		pushJsonbValue(state, WJB_VALUE, &v);
+	}
+	/* Relations which are not visible in search_path keep their schema */
+	else if (RelnameGetRelid(relname) != relid)
+	{
+		char *schema = get_namespace_name(get_rel_namespace(relid));
+
+		v.val.string.val = "schema";
+		v.val.string.len = 6;
+		pushJsonbValue(state, WJB_KEY, &v);
+		v.val.string.val = schema;
+		v.val.string.len = strlen(schema);
+		pushJsonbValue(state, WJB_VALUE, &v);
+	}
+
+	pushJsonbValue(state, WJB_END_OBJECT, NULL);
+}
+
+/*
+ * Make template of plan: names of relations and their indexes, so that
+ * the plan can be bound to relations of another schema in search_path.
+ * Result is {"oid": {"name": relname[, "schema": nspname][, "table": oid]}}.
+ * Returns NULL if plan depends on functions other than _p: they are
+ * not bound by name.
+ */
+Jsonb *
+sr_plan_make_template(PlannedStmt *pl_stmt, Oid fake_func)
+{
+	JsonbParseState *state = NULL;
+	JsonbValue *result;
+	List	   *relids = NIL;
+	ListCell   *lc;
+	uint32		fake_func_hash;
+
+	fake_func_hash = GetSysCacheHashValue1(PROCOID, ObjectIdGetDatum(fake_func));
+	foreach(lc, pl_stmt->invalItems)
+	{
+		PlanInvalItem *item = (PlanInvalItem *) lfirst(lc);
+
+		if (item->cacheId != PROCOID || item->hashValue != fake_func_hash)
+			return NULL;
+	}
+
+	foreach(lc, pl_stmt->relationOids)
+		relids = list_append_unique_oid(relids, lfirst_oid(lc));
+
+	pushJsonbValue(&state, WJB_BEGIN_OBJECT, NULL);
+	foreach(lc, relids)
+	{
+		Oid			relid = lfirst_oid(lc);
+		Relation	rel;
+		List	   *indexes;
+		ListCell   *ilc;
+
+		sr_plan_add_template_rel(&state, relid, InvalidOid);
+
+		rel = RelationIdGetRelation(relid);
+		if (!RelationIsValid(rel))
+			continue;
+		indexes = RelationGetIndexList(rel);
+		RelationClose(rel);
+
+		foreach(ilc, indexes)
+			sr_plan_add_template_rel(&state, lfirst_oid(ilc), relid);
+		list_free(indexes);
+	}
+	result = pushJsonbValue(&state, WJB_END_OBJECT, NULL);
+	list_free(relids);
+
+	return JsonbValueToJsonb(result);
+}
+
+static char *
+sr_plan_template_field(JsonbValue *rel, const char *name)
+{
+	JsonbValue	key;
+	JsonbValue *value;
+
+	key.type = jbvString;
+	key.val.string.val = (char *) name;
+	key.val.string.len = strlen(name);
+
+	value = findJsonbValueFromContainer(rel->val.binary.data, JB_FOBJECT, &key);
+	if (value == NULL || value->type != jbvString)
+		return NULL;
+
+	return pnstrdup(value->val.string.val, value->val.string.len);
+}
+
+/*
+ * Resolve relations of template in the current search_path,
+ * NULL if some of them don't exist.
+ */
+static SrPlanBinding *
+sr_plan_bind_template(Jsonb *template)
+{
+	SrPlanBinding  *binding;
+	JsonbIterator  *it;
+	JsonbValue		v;
+	int				type;
+	int				nrels = 0;
+	int				maxrels = Max(JB_ROOT_COUNT(template), 1);
+	int				i;
+	char		  **names;
+	Oid			   *tables;
+	Oid				from = InvalidOid;
+
+	binding = (SrPlanBinding *) palloc(sizeof(SrPlanBinding));
+	binding->from = (Oid *) palloc(maxrels * sizeof(Oid));
+	binding->to = (Oid *) palloc(maxrels * sizeof(Oid));
+	names = (char **) palloc(maxrels * sizeof(char *));
+	tables = (Oid *) palloc(maxrels * sizeof(Oid));
+
+	it = JsonbIteratorInit(&template->root);
+	while ((type = JsonbIteratorNext(&it, &v, true)) != WJB_DONE)
+	{
+		char   *schema;
+		char   *table;
+
+		if (type == WJB_KEY)
+		{
+			from = (Oid) strtoul(pnstrdup(v.val.string.val, v.val.string.len),
+								 NULL, 10);
+			continue;
+		}
+
+		if (type != WJB_VALUE || v.type != jbvBinary)
+			continue;
+
+		names[nrels] = sr_plan_template_field(&v, "name");
+		schema = sr_plan_template_field(&v, "schema");
+		table = sr_plan_template_field(&v, "table");
+		if (names[nrels] == NULL)
+			return NULL;
+
+		binding->from[nrels] = from;
+		tables[nrels] = table ? (Oid) strtoul(table, NULL, 10) : InvalidOid;
+
+		/* Indexes are resolved when their tables are known */
+		if (OidIsValid(tables[nrels]))
+			binding->to[nrels] = InvalidOid;
+		else if (schema != NULL)
+			binding->to[nrels] = get_relname_relid(names[nrels],
+												   get_namespace_oid(schema, true));
+		else
+			binding->to[nrels] = RelnameGetRelid(names[nrels]);
+
+		if (!OidIsValid(tables[nrels]) && !OidIsValid(binding->to[nrels]))
+			return NULL;
+		nrels++;
+	}
+	binding->nrels = nrels;
+
+	for (i = 0; i < nrels; i++)
+	{
+		Oid		table;
+
+		if (!OidIsValid(tables[i]))
+			continue;
+
+		table = sr_plan_bound_oid(binding, tables[i]);
+		binding->to[i] = get_relname_relid(names[i], get_rel_namespace(table));
+		if (!OidIsValid(binding->to[i]))
+			return NULL;
+	}
+
+	return binding;
+}
+
+static void
+sr_plan_bindings_reset(Datum arg, int cacheid, uint32 hashvalue)
+{
+	if (bindings_cxt != NULL)
+		MemoryContextReset(bindings_cxt);
+	bindings = NULL;
+}
+
+static SrPlanBinding *
+sr_plan_copy_binding(SrPlanBinding *binding)
+{
+	SrPlanBinding *result;
+
+	result = (SrPlanBinding *) palloc(sizeof(SrPlanBinding));
+	result->nrels = binding->nrels;
+	result->from = (Oid *) palloc(Max(binding->nrels, 1) * sizeof(Oid));
+	result->to = (Oid *) palloc(Max(binding->nrels, 1) * sizeof(Oid));
+	memcpy(result->from, binding->from, binding->nrels * sizeof(Oid));
+	memcpy(result->to, binding->to, binding->nrels * sizeof(Oid));
+
+	return result;
+}
+
+/*
+ * Get binding of template plan to relations in the current search_path.
+ * Bindings are cached until some relation is created, renamed or dropped.
+ * Returns NULL if the template can't be bound.
+ */
+SrPlanBinding *
+sr_plan_get_binding(int32 query_hash, int32 plan_hash, Jsonb *template)
+{
+	SrPlanBindingKey	key;
+	SrPlanBindingEntry *entry;
+	SrPlanBinding	   *binding;
+	List			   *search_path;
+	ListCell		   *lc;
+	MemoryContext		oldcxt;
+
+	if (bindings_cxt == NULL)
+	{
+		bindings_cxt = AllocSetContextCreate(TopMemoryContext,
+											 "sr_plan template bindings",
+											 ALLOCSET_DEFAULT_MINSIZE,
+											 ALLOCSET_DEFAULT_INITSIZE,
+											 ALLOCSET_DEFAULT_MAXSIZE);
+		CacheRegisterSyscacheCallback(RELNAMENSP, sr_plan_bindings_reset,
+									  (Datum) 0);
+	}
+
+	search_path = fetch_search_path(false);
+
+	memset(&key, 0, sizeof(key));
+	key.query_hash = query_hash;
+	key.plan_hash = plan_hash;
+	foreach(lc, search_path)
+		key.search_path_hash = ((key.search_path_hash << 1) |
+								(key.search_path_hash >> 31)) ^ lfirst_oid(lc);
+
+	if (bindings != NULL)
+	{
+		entry = (SrPlanBindingEntry *) hash_search(bindings, &key, HASH_FIND, NULL);
+		if (entry && equal(entry->search_path, search_path))
+		{
+			list_free(search_path);
+			return entry->binding ? sr_plan_copy_binding(entry->binding) : NULL;
+		}
+	}
+
+	/* Catalog lookups may reset the cache, so bind outside of it */
+	binding = sr_plan_bind_template(template);
+
+	oldcxt = MemoryContextSwitchTo(bindings_cxt);
+	if (bindings == NULL)
+	{
+		HASHCTL		ctl;
+
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(SrPlanBindingKey);
+		ctl.entrysize = sizeof(SrPlanBindingEntry);
+		ctl.hcxt = bindings_cxt;
+		bindings = hash_create("sr_plan template bindings", 64, &ctl,
+							   HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	}
+	entry = (SrPlanBindingEntry *) hash_search(bindings, &key, HASH_ENTER, NULL);
+	entry->search_path = list_copy(search_path);
+	entry->binding = binding ? sr_plan_copy_binding(binding) : NULL;
+	MemoryContextSwitchTo(oldcxt);
+
+	list_free(search_path);
+
+	return binding;
+}
+
+static bool
+sr_plan_query_relids(Node *node, void *context)
+{
+	List	  **relids = (List **) context;
+
+	if (node == NULL)
+		return false;
+
+	if (IsA(node, RangeTblEntry))
+	{
+		if (((RangeTblEntry *) node)->rtekind == RTE_RELATION)
+			*relids = list_append_unique_oid(*relids, ((RangeTblEntry *) node)->relid);
+		return false;
+	}
+
+	if (IsA(node, Query))
+		return query_tree_walker((Query *) node, sr_plan_query_relids,
+								 context, QTW_EXAMINE_RTES);
+
+	return expression_tree_walker(node, sr_plan_query_relids, context);
+}
+
+/*
+ * Check that template is bound to the relations the query was parsed to.
+ * Names are resolved in search_path or in the schema saved with template,
+ * while the query may name relations of another schema explicitly.
+ */
+bool
+sr_plan_binding_matches(SrPlanBinding *binding, Query *parse)
+{
+	List	   *relids = NIL;
+	ListCell   *lc;
+	bool		result = true;
+
+	(void) query_tree_walker(parse, sr_plan_query_relids,
+							 (void *) &relids, QTW_EXAMINE_RTES);
+
+	foreach(lc, relids)
+	{
+		int		i;
+
+		for (i = 0; i < binding->nrels; i++)
+		{
+			if (binding->to[i] == lfirst_oid(lc))
+				break;
+		}
+
+		if (i == binding->nrels)
+		{
+			result = false;
+			break;
+		}
+	}
+	list_free(relids);
+
+	return result;
+}
+
+/*
+ * Map relation of template to the bound one, other Oids are kept.
+ */
+Oid
+sr_plan_bound_oid(SrPlanBinding *binding, Oid relid)
+{
+	int		i;
+
+	for (i = 0; i < binding->nrels; i++)
+	{
+		if (binding->from[i] == relid)
+			return binding->to[i];
+	}
+
+	return relid;
+}
+
+/*
+ * Replace Oids of template relations in deserialized plan node.
+ */
+void *
+sr_plan_bind_node(void *node, SrPlanBinding *binding)
+{
+	ListCell   *lc;
+
+	if (node == NULL)
+		return NULL;
+
+	switch (nodeTag(node))
+	{
+		case T_RangeTblEntry:
+			if (((RangeTblEntry *) node)->rtekind == RTE_RELATION)
+				((RangeTblEntry *) node)->relid =
+					sr_plan_bound_oid(binding, ((RangeTblEntry *) node)->relid);
+			break;
+		case T_IndexScan:
+			((IndexScan *) node)->indexid =
+				sr_plan_bound_oid(binding, ((IndexScan *) node)->indexid);
+			break;
+		case T_IndexOnlyScan:
+			((IndexOnlyScan *) node)->indexid =
+				sr_plan_bound_oid(binding, ((IndexOnlyScan *) node)->indexid);
+			break;
+		case T_BitmapIndexScan:
+			((BitmapIndexScan *) node)->indexid =
+				sr_plan_bound_oid(binding, ((BitmapIndexScan *) node)->indexid);
+			break;
+		case T_Const:
+			/* regclass constants, e.g. of nextval('seq') */
+			if (((Const *) node)->consttype == REGCLASSOID &&
+				!((Const *) node)->constisnull)
+				((Const *) node)->constvalue = ObjectIdGetDatum(
+					sr_plan_bound_oid(binding,
+									  DatumGetObjectId(((Const *) node)->constvalue)));
+			break;
+		case T_TargetEntry:
+			((TargetEntry *) node)->resorigtbl =
+				sr_plan_bound_oid(binding, ((TargetEntry *) node)->resorigtbl);
+			break;
+		case T_ModifyTable:
+			foreach(lc, ((ModifyTable *) node)->arbiterIndexes)
+				lfirst_oid(lc) = sr_plan_bound_oid(binding, lfirst_oid(lc));
+			break;
+		case T_PlannedStmt:
+			foreach(lc, ((PlannedStmt *) node)->relationOids)
+				lfirst_oid(lc) = sr_plan_bound_oid(binding, lfirst_oid(lc));
+			break;
+		default:
+			break;
+	}
+
+	return node;
+}
@@ -0,0 +1,195 @@
+#include "sr_plan.h"
+#include "access/hash.h"
+#include "utils/array.h"
+
+/* Each dependency is (relid, relfilenode, row type signature, index set signature) */
+#define SR_PLAN_DEP_WIDTH	4
+
+static uint32 sr_plan_rowtype_signature(Relation rel);
+static uint32 sr_plan_indexes_signature(Relation rel);
+
+/*
+ * Signature of relation's row type: changes when a column
+ * is added, dropped or gets another type.
+ */
+static uint32
+sr_plan_rowtype_signature(Relation rel)
+{
+	TupleDesc	desc = RelationGetDescr(rel);
+	uint32		hash = (uint32) desc->natts;
+	int			i;
+
+	for (i = 0; i < desc->natts; i++)
+	{
+		Form_pg_attribute	attr = desc->attrs[i];
+		uint32				attr_hash;
+
+		attr_hash = attr->attisdropped ?
+			0 : DatumGetUInt32(hash_uint32(attr->atttypid)) ^ (uint32) attr->atttypmod;
+		hash = ((hash << 1) | (hash >> 31)) ^ attr_hash;
+	}
+
+	return hash;
+}
+
+/*
+ * Signature of relation's indexes: changes when an index
+ * is created or dropped.
+ */
+static uint32
+sr_plan_indexes_signature(Relation rel)
+{
+	List	   *indexes = RelationGetIndexList(rel);
+	uint32		hash = (uint32) list_length(indexes);
+	ListCell   *lc;
+
+	foreach(lc, indexes)
+		hash = ((hash << 1) | (hash >> 31)) ^
+			DatumGetUInt32(hash_uint32(lfirst_oid(lc)));
+	list_free(indexes);
+
+	return hash;
+}
+
+/*
+ * Get current version of relation, false if it doesn't exist.
+ * GRANT, ALTER TABLE SET and other changes which don't affect plans
+ * keep the version.
+ */
+static bool
+sr_plan_rel_version(Oid relid, Oid *relfilenode, uint32 *signature,
+					uint32 *indexes)
+{
+	Relation	rel;
+
+	rel = RelationIdGetRelation(relid);
+	if (!RelationIsValid(rel))
+		return false;
+
+	/* Table rewrite, e.g. VACUUM FULL or ALTER COLUMN TYPE, changes relfilenode */
+	*relfilenode = rel->rd_node.relNode;
+	*signature = sr_plan_rowtype_signature(rel);
+	*indexes = sr_plan_indexes_signature(rel);
+	RelationClose(rel);
+
+	return true;
+}
+
+/*
+ * Make version vector of relations plan depends on.
+ */
+ArrayType *
+sr_plan_make_deps(List *relationOids)
+{
+	List	   *relids = NIL;
+	ListCell   *lc;
+	Datum	   *elems;
+	int			nelems = 0;
+
+	foreach(lc, relationOids)
+		relids = list_append_unique_oid(relids, lfirst_oid(lc));
+
+	elems = (Datum *) palloc(Max(list_length(relids), 1) *
+							 SR_PLAN_DEP_WIDTH * sizeof(Datum));
+	foreach(lc, relids)
+	{
+		Oid		relid = lfirst_oid(lc);
+		Oid		relfilenode;
+		uint32	signature;
+		uint32	indexes;
+
+		if (!sr_plan_rel_version(relid, &relfilenode, &signature, &indexes))
+			continue;
+
+		elems[nelems++] = ObjectIdGetDatum(relid);
+		elems[nelems++] = ObjectIdGetDatum(relfilenode);
+		elems[nelems++] = ObjectIdGetDatum((Oid) signature);
+		elems[nelems++] = ObjectIdGetDatum((Oid) indexes);
+	}
+	list_free(relids);
+
+	return construct_array(elems, nelems, OIDOID,
+						   sizeof(Oid), true, 'i');
+}
+
+/*
+ * Check that relations plan depends on haven't changed since capture.
+ * It's much cheaper than planning: a relcache lookup per relation.
+ * Relations of template plan are mapped by binding, only their row types
+ * are compared since they are other relations than the captured ones.
+ * Relations which are not in relids (e.g. detached partitions) are skipped.
+ * Relations of relids which are not in deps are partitions attached after
+ * capture, their row type has to be one of the captured ones.
+ */
+bool
+sr_plan_check_deps(ArrayType *deps, SrPlanBinding *binding, List *relids)
+{
+	Oid	   *elems;
+	int		nelems,
+			i;
+	List   *checked = NIL;
+	ListCell *lc;
+
+	if (ARR_NDIM(deps) == 0)
+		return true;
+
+	if (ARR_NDIM(deps) != 1 || ARR_HASNULL(deps) ||
+		ARR_ELEMTYPE(deps) != OIDOID)
+		return false;
+
+	elems = (Oid *) ARR_DATA_PTR(deps);
+	nelems = ARR_DIMS(deps)[0];
+	if (nelems % SR_PLAN_DEP_WIDTH != 0)
+		return false;
+
+	for (i = 0; i < nelems; i += SR_PLAN_DEP_WIDTH)
+	{
+		Oid		relfilenode;
+		uint32	signature;
+		uint32	indexes;
+		Oid		relid = elems[i];
+
+		if (binding)
+			relid = sr_plan_bound_oid(binding, relid);
+
+		if (!list_member_oid(relids, relid))
+			continue;
+		checked = lappend_oid(checked, relid);
+
+		if (!sr_plan_rel_version(relid, &relfilenode, &signature, &indexes) ||
+			(Oid) signature != elems[i + 2] ||
+			(!binding &&
+			 (relfilenode != elems[i + 1] || (Oid) indexes != elems[i + 3])))
+		{
+			list_free(checked);
+			return false;
+		}
+	}
+
+	foreach(lc, relids)
+	{
+		Oid		relfilenode;
+		uint32	signature;
+		uint32	indexes;
+		bool	found = false;
+
+		if (list_member_oid(checked, lfirst_oid(lc)))
+			continue;
+
+		if (sr_plan_rel_version(lfirst_oid(lc), &relfilenode, &signature, &indexes))
+		{
+			for (i = 0; !found && i < nelems; i += SR_PLAN_DEP_WIDTH)
+				found = ((Oid) signature == elems[i + 2]);
+		}
+
+		if (!found)
+		{
+			list_free(checked);
+			return false;
+		}
+		checked = lappend_oid(checked, lfirst_oid(lc));
+	}
+	list_free(checked);
+
+	return true;
+}
@@ -0,0 +1,297 @@
+#include "sr_plan.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "access/xact.h"
+#include "catalog/namespace.h"
+#include "executor/spi.h"
+#include "postmaster/bgworker.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/proc.h"
+#include "utils/lsyscache.h"
+
+PG_FUNCTION_INFO_V1(sr_plan_evict);
+
+static volatile sig_atomic_t got_sighup = false;
+static volatile sig_atomic_t got_sigterm = false;
+
+static void sr_plan_maintenance_sighup(SIGNAL_ARGS);
+static void sr_plan_maintenance_sigterm(SIGNAL_ARGS);
+static void sr_plan_flush_stats(const char *sr_plans_name);
+static int sr_plan_evict_plans(const char *sr_plans_name);
+static int sr_plan_delete_expired(const char *sr_plans_name);
+
+/*
+ * Register maintenance worker which flushes hit counters and
+ * evicts plans from "sr_plans" every sr_plan.maintenance_naptime seconds.
+ */
+void
+sr_plan_register_maintenance_worker(void)
+{
+	BackgroundWorker worker;
+
+	if (sr_plan_maintenance_database == NULL ||
+		sr_plan_maintenance_database[0] == '\0')
+		return;
+
+	memset(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
+		BGWORKER_BACKEND_DATABASE_CONNECTION;
+	worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+	worker.bgw_restart_time = 60;
+	snprintf(worker.bgw_name, BGW_MAXLEN, "sr_plan maintenance");
+	snprintf(worker.bgw_library_name, BGW_MAXLEN, "sr_plan");
+	snprintf(worker.bgw_function_name, BGW_MAXLEN, "sr_plan_maintenance_main");
+	worker.bgw_main_arg = (Datum) 0;
+	worker.bgw_notify_pid = 0;
+
+	RegisterBackgroundWorker(&worker);
+}
+
+static void
+sr_plan_maintenance_sighup(SIGNAL_ARGS)
+{
+	int			save_errno = errno;
+
+	got_sighup = true;
+	SetLatch(MyLatch);
+
+	errno = save_errno;
+}
+
+static void
+sr_plan_maintenance_sigterm(SIGNAL_ARGS)
+{
+	int			save_errno = errno;
+
+	got_sigterm = true;
+	SetLatch(MyLatch);
+
+	errno = save_errno;
+}
+
+void
+sr_plan_maintenance_main(Datum main_arg)
+{
+	pqsignal(SIGHUP, sr_plan_maintenance_sighup);
+	pqsignal(SIGTERM, sr_plan_maintenance_sigterm);
+	BackgroundWorkerUnblockSignals();
+
+	BackgroundWorkerInitializeConnection(sr_plan_maintenance_database, NULL);
+
+	while (!got_sigterm)
+	{
+		int		rc;
+		Oid		schema_oid;
+
+		rc = WaitLatch(MyLatch,
+					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+#if PG_VERSION_NUM >= 100000
+					   sr_plan_maintenance_naptime * 1000L,
+					   PG_WAIT_EXTENSION);
+#else
+					   sr_plan_maintenance_naptime * 1000L);
+#endif
+		ResetLatch(MyLatch);
+
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+
+		CHECK_FOR_INTERRUPTS();
+
+		if (got_sigterm)
+			break;
+
+		if (got_sighup)
+		{
+			got_sighup = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		SetCurrentStatementStartTimestamp();
+		StartTransactionCommand();
+		PushActiveSnapshot(GetTransactionSnapshot());
+		pgstat_report_activity(STATE_RUNNING, "sr_plan maintenance");
+
+		/* Do nothing until somebody creates the extension */
+		schema_oid = get_sr_plan_schema();
+		if (OidIsValid(schema_oid))
+			sr_plan_run_maintenance(schema_oid);
+
+		PopActiveSnapshot();
+		CommitTransactionCommand();
+		pgstat_report_stat(false);
+		pgstat_report_activity(STATE_IDLE, NULL);
+	}
+
+	proc_exit(0);
+}
+
+/*
+ * Write pending hit counters and plans disabled by executor feedback
+ * into "sr_plans", delete expired plans and evict plans exceeding
+ * sr_plan.max_plans. Returns number of deleted plans.
+ */
+int
+sr_plan_run_maintenance(Oid schema_oid)
+{
+	char	   *schema_name;
+	char	   *sr_plans_name;
+	int			evicted = 0;
+
+	schema_name = get_namespace_name(schema_oid);
+	sr_plans_name = quote_qualified_identifier(schema_name, SR_PLANS_TABLE_NAME);
+
+	/* Don't look up or capture our own queries */
+	sr_plan_bypass = true;
+	PG_TRY();
+	{
+		if (SPI_connect() != SPI_OK_CONNECT)
+			elog(ERROR, "could not connect using SPI");
+
+		sr_plan_flush_stats(sr_plans_name);
+		evicted = sr_plan_delete_expired(sr_plans_name);
+		if (sr_plan_max_plans > 0)
+			evicted += sr_plan_evict_plans(sr_plans_name);
+
+		SPI_finish();
+	}
+	PG_CATCH();
+	{
+		sr_plan_bypass = false;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+	sr_plan_bypass = false;
+
+	pfree(sr_plans_name);
+	pfree(schema_name);
+
+	return evicted;
+}
+
+static void
+sr_plan_flush_stats(const char *sr_plans_name)
+{
+	SrPlanStatsEntry   *entries;
+	int					nentries,
+						i;
+	StringInfoData		sql;
+	SPIPlanPtr			plan;
+	Oid					argtypes[7] = {INT8OID, TIMESTAMPTZOID, INT4OID, INT4OID,
+									   BOOLOID, TEXTOID, INT4OID};
+
+	entries = sr_plan_drain_stats(&nentries);
+	if (nentries == 0)
+		return;
+
+	initStringInfo(&sql);
+	appendStringInfo(&sql,
+					 "UPDATE %s SET hits = hits + $1, "
+					 "last_hit = greatest(last_hit, $2), "
+					 "enable = enable AND NOT $5, "
+					 "reason = coalesce($6, reason) "
+					 "WHERE query_hash = $3 AND plan_hash = $4 "
+					 "AND hashtext(profile) = $7",
+					 sr_plans_name);
+
+	plan = SPI_prepare(sql.data, 7, argtypes);
+	if (plan == NULL)
+		elog(ERROR, "could not prepare \"%s\"", sql.data);
+
+	for (i = 0; i < nentries; i++)
+	{
+		Datum	values[7];
+		char	nulls[7] = {' ', ' ', ' ', ' ', ' ', 'n', ' '};
+
+		values[0] = Int64GetDatum(entries[i].hits);
+		values[1] = TimestampTzGetDatum(entries[i].last_hit);
+		values[2] = Int32GetDatum(entries[i].key.query_hash);
+		values[3] = Int32GetDatum(entries[i].key.plan_hash);
+		values[4] = BoolGetDatum(entries[i].disabled);
+		values[6] = Int32GetDatum(entries[i].key.profile_hash);
+
+		/* Plan was disabled by executor feedback */
+		if (entries[i].disabled)
+		{
+			values[5] = CStringGetTextDatum(psprintf("rows misestimated by factor of %.0f in %d executions in a row",
+													 entries[i].max_error,
+													 entries[i].bad_samples));
+			nulls[5] = ' ';
+		}
+
+		if (SPI_execute_plan(plan, values, nulls, false, 0) != SPI_OK_UPDATE)
+			elog(ERROR, "could not update hit counters of %s", sr_plans_name);
+	}
+
+	SPI_freeplan(plan);
+	pfree(sql.data);
+	pfree(entries);
+}
+
+/*
+ * Delete disabled plans until "sr_plans" fits into sr_plan.max_plans.
+ * Invalid plans go first, then the ones chosen by sr_plan.eviction_policy.
+ */
+static int
+sr_plan_evict_plans(const char *sr_plans_name)
+{
+	StringInfoData		sql;
+	Oid					argtypes[1] = {INT8OID};
+	Datum				values[1];
+	const char		   *order_by;
+
+	if (sr_plan_eviction_policy == SR_PLAN_EVICT_HITS)
+		order_by = "hits, last_hit NULLS FIRST";
+	else
+		order_by = "last_hit NULLS FIRST, hits";
+
+	initStringInfo(&sql);
+	appendStringInfo(&sql,
+					 "DELETE FROM %s WHERE ctid = ANY (ARRAY("
+					 "SELECT ctid FROM %s WHERE NOT enable "
+					 "ORDER BY valid, %s "
+					 "LIMIT greatest((SELECT count(*) FROM %s) - $1, 0)))",
+					 sr_plans_name, sr_plans_name, order_by, sr_plans_name);
+
+	values[0] = Int64GetDatum((int64) sr_plan_max_plans);
+
+	if (SPI_execute_with_args(sql.data, 1, argtypes, values, NULL,
+							  false, 0) != SPI_OK_DELETE)
+		elog(ERROR, "could not evict plans from %s", sr_plans_name);
+
+	pfree(sql.data);
+
+	return (int) SPI_processed;
+}
+
+/*
+ * Delete plans saved by plan cache whose TTL has expired.
+ */
+static int
+sr_plan_delete_expired(const char *sr_plans_name)
+{
+	StringInfoData		sql;
+
+	initStringInfo(&sql);
+	appendStringInfo(&sql, "DELETE FROM %s WHERE expires < now()",
+					 sr_plans_name);
+
+	if (SPI_execute(sql.data, false, 0) != SPI_OK_DELETE)
+		elog(ERROR, "could not delete expired plans from %s", sr_plans_name);
+
+	pfree(sql.data);
+
+	return (int) SPI_processed;
+}
+
+Datum
+sr_plan_evict(PG_FUNCTION_ARGS)
+{
+	Oid		schema_oid = get_sr_plan_schema();
+
+	if (!OidIsValid(schema_oid))
+		elog(ERROR, "Cannot find sr_plan schema");
+
+	PG_RETURN_INT32(sr_plan_run_maintenance(schema_oid));
+}